@@ -0,0 +1,218 @@
+/* Run fl on a pseudo terminal and replay a script of keys, measuring how
+ * long every key takes to be drawn: from the key being sent to the last
+ * output before the screen is idle.
+ *
+ * Script lines, # starts a comment:
+ *   wait [MS]       Wait for the screen to be idle for MS (WAIT_MS by
+ *                   default), as after startup or a load
+ *   keys K...       Send keys, one at a time, each after the last is drawn
+ *   repeat N K...   Send keys N times
+ * Keys are a single char, a name (Enter, Esc, Space, Up, Down, PgUp, PgDn,
+ * Home, End) or a word, typed char by char. Every line is reported with
+ * the percentiles of its keys. fl gets a q when the script ends. */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../flag/flag.h"
+#include "../frog/frog.h"
+
+/* The screen is idle after this long without output after a key */
+#define IDLE_MS 30
+/* Loads draw in bursts, so wait waits longer */
+#define WAIT_MS 300
+
+typedef DA(long long) time_da;
+
+static const struct {
+        const char *name;
+        const char *seq;
+} KEYS[] = {
+        { "Enter", "\r" },
+        { "Esc", "\e" },
+        { "Space", " " },
+        { "Up", "\e[A" },
+        { "Down", "\e[B" },
+        { "PgUp", "\e[5~" },
+        { "PgDn", "\e[6~" },
+        { "Home", "\e[H" },
+        { "End", "\e[F" },
+};
+
+int master = -1;
+long long output = 0; /* Bytes read from fl */
+
+long long
+now_ns()
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Read the output of fl until there is none for idle ms. Return when the
+ * last of it came, or since if there was none */
+long long
+settle(long long since, int idle)
+{
+        static char buf[1 << 16];
+        struct pollfd p = { .fd = master, .events = POLLIN };
+        long long last = since;
+        ssize_t n;
+
+        while (poll(&p, 1, idle) > 0) {
+                if ((n = read(master, buf, sizeof buf)) <= 0) break; /* fl exited */
+                output += n;
+                last = now_ns();
+        }
+        return last;
+}
+
+/* Send seq and wait for it to be drawn. Return the time taken */
+long long
+send_key(const char *seq)
+{
+        long long start = now_ns();
+
+        if (write(master, seq, strlen(seq)) < 0) {
+                perror("drive: write");
+                exit(1);
+        }
+        return settle(start, IDLE_MS) - start;
+}
+
+/* Send every key of token to times */
+void
+send_token(const char *token, time_da *times)
+{
+        char seq[2] = { 0 };
+        int i;
+
+        for (i = 0; i < (int) (sizeof KEYS / sizeof *KEYS); i++)
+                if (!strcmp(token, KEYS[i].name)) {
+                        da_append(times, send_key(KEYS[i].seq));
+                        return;
+                }
+        for (i = 0; token[i]; i++) {
+                seq[0] = token[i];
+                da_append(times, send_key(seq));
+        }
+}
+
+int
+time_cmp(const void *a, const void *b)
+{
+        long long x = *(const long long *) a, y = *(const long long *) b;
+        return (x > y) - (x < y);
+}
+
+/* Print the percentiles of times, in ms */
+void
+report_times(const char *what, time_da *times)
+{
+        long long *t = times->data;
+        int n = times->size;
+
+        if (!n) return;
+        qsort(t, n, sizeof *t, time_cmp);
+        printf("%-32.32s %6d keys  p50 %8.2f  p90 %8.2f  p99 %8.2f  max %8.2f ms\n", what, n,
+               t[n / 2] / 1e6, t[n * 9 / 10] / 1e6, t[n * 99 / 100] / 1e6, t[n - 1] / 1e6);
+}
+
+/* Start argv on a new pseudo terminal of rows x cols */
+pid_t
+spawn(char **argv, int rows, int cols)
+{
+        struct winsize ws = { .ws_row = rows, .ws_col = cols };
+        pid_t pid;
+        int slave;
+
+        if ((master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC)) < 0 ||
+            grantpt(master) || unlockpt(master) || ioctl(master, TIOCSWINSZ, &ws)) {
+                perror("drive: pseudo terminal");
+                exit(1);
+        }
+        if ((pid = fork()) < 0) {
+                perror("drive: fork");
+                exit(1);
+        }
+        if (pid) return pid;
+
+        /* The terminal becomes the controlling one, so /dev/tty is it too */
+        setsid();
+        if ((slave = open(ptsname(master), O_RDWR)) < 0) _exit(127);
+        dup2(slave, 0);
+        dup2(slave, 1);
+        dup2(slave, 2);
+        if (slave > 2) close(slave);
+        execvp(argv[0], argv);
+        _exit(127);
+}
+
+int
+main(int argc, char *argv[])
+{
+        static time_da times = { 0 };
+        char line[4096], label[4096], keys[4096];
+        char *value, *token, *save;
+        long long start;
+        int rows = 40, cols = 120, count, i, status;
+        FILE *script;
+        pid_t pid;
+
+        flag_set(&argc, &argv);
+        if (flag_get_value(&value, "-r", "--rows")) rows = atoi(value);
+        if (flag_get_value(&value, "-c", "--cols")) cols = atoi(value);
+        if (argc < 3 || rows <= 1 || cols <= 0) {
+                fprintf(stderr, "usage: drive [-r rows] [-c cols] SCRIPT FL [ARGS...]\n");
+                return 1;
+        }
+        if (!(script = fopen(argv[1], "r"))) {
+                fprintf(stderr, "drive: can not open %s: %s\n", argv[1], strerror(errno));
+                return 1;
+        }
+
+        pid = spawn(argv + 2, rows, cols);
+        while (fgets(line, sizeof line, script)) {
+                line[strcspn(line, "#\n")] = 0;
+                snprintf(label, sizeof label, "%s", line + strspn(line, " \t"));
+                if (!(token = strtok_r(line, " \t", &save))) continue;
+                times.size = 0;
+                if (!strcmp(token, "wait")) {
+                        value = strtok_r(NULL, " \t", &save);
+                        start = now_ns();
+                        da_append(&times, settle(start, value ? atoi(value) : WAIT_MS) - start);
+                } else if (!strcmp(token, "keys") || !strcmp(token, "repeat")) {
+                        count = 1;
+                        if (!strcmp(token, "repeat")) count = atoi(strtok_r(NULL, " \t", &save) ?: "0");
+                        snprintf(keys, sizeof keys, "%s", save ? save : "");
+                        for (i = 0; i < count; i++) {
+                                strcpy(line, keys);
+                                for (token = strtok_r(line, " \t", &save); token; token = strtok_r(NULL, " \t", &save))
+                                        send_token(token, &times);
+                        }
+                } else {
+                        fprintf(stderr, "drive: unknown command: %s\n", token);
+                        break;
+                }
+                report_times(label, &times);
+        }
+        fclose(script);
+
+        send_key("q");
+        waitpid(pid, &status, 0);
+        printf("%lld bytes drawn\n", output);
+        return !WIFEXITED(status) || WEXITSTATUS(status);
+}
@@ -0,0 +1,105 @@
+/* Make a synthetic tree to benchmark fl: every folder has some files and
+ * some subfolders, down to some depth. Files are empty, so millions of
+ * entries only cost inodes. */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../flag/flag.h"
+
+struct {
+        long files;   /* Per folder */
+        long folders; /* Subfolders per folder */
+        int depth;    /* Levels of subfolders */
+        int namelen;  /* Of every name, at least what the number needs */
+        long limit;   /* Entries in total, 0 for no limit */
+        long made;
+} shape = { .files = 1000, .folders = 0, .depth = 0, .namelen = 0 };
+
+/* Name of the i-th entry of a folder: the number, padded to namelen with
+ * letters, so names of the same length still sort in many ways */
+void
+make_name(char *buf, int size, const char *prefix, long i)
+{
+        int n = snprintf(buf, size, "%s%ld", prefix, i);
+
+        while (n < shape.namelen && n < size - 1) {
+                buf[n] = 'a' + (i + n) % 26;
+                n++;
+        }
+        buf[n] = 0;
+}
+
+int
+more()
+{
+        return !shape.limit || shape.made < shape.limit;
+}
+
+int
+make_tree(int dirfd, int depth)
+{
+        char name[NAME_MAX + 1];
+        long i;
+        int fd, sub;
+
+        for (i = 0; i < shape.files && more(); i++, shape.made++) {
+                make_name(name, sizeof name, "f", i);
+                if ((fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_CLOEXEC, 0644)) < 0) {
+                        fprintf(stderr, "gen: can not create %s: %s\n", name, strerror(errno));
+                        return -1;
+                }
+                close(fd);
+        }
+        if (depth >= shape.depth) return 0;
+        for (i = 0; i < shape.folders && more(); i++, shape.made++) {
+                make_name(name, sizeof name, "d", i);
+                if (mkdirat(dirfd, name, 0755) && errno != EEXIST) {
+                        fprintf(stderr, "gen: can not create %s: %s\n", name, strerror(errno));
+                        return -1;
+                }
+                if ((sub = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) return -1;
+                if (make_tree(sub, depth + 1)) {
+                        close(sub);
+                        return -1;
+                }
+                close(sub);
+        }
+        return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+        char *value;
+        int fd;
+
+        flag_set(&argc, &argv);
+        if (flag_get_value(&value, "-w", "--files")) shape.files = atol(value);
+        if (flag_get_value(&value, "-b", "--folders")) shape.folders = atol(value);
+        if (flag_get_value(&value, "-d", "--depth")) shape.depth = atoi(value);
+        if (flag_get_value(&value, "-l", "--name-length")) shape.namelen = atoi(value);
+        if (flag_get_value(&value, "-n", "--limit")) shape.limit = atol(value);
+        if (argc != 2 || shape.files < 0 || shape.folders < 0 || shape.depth < 0 ||
+            shape.namelen < 0 || shape.namelen > NAME_MAX || shape.limit < 0) {
+                fprintf(stderr, "usage: gen [-w files] [-b folders] [-d depth] "
+                                "[-l name-length] [-n limit] DIR\n");
+                return 1;
+        }
+
+        if (mkdir(argv[1], 0755) && errno != EEXIST) {
+                fprintf(stderr, "gen: can not create %s: %s\n", argv[1], strerror(errno));
+                return 1;
+        }
+        if ((fd = open(argv[1], O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0 || make_tree(fd, 0)) return 1;
+        printf("%s: %ld entries\n", argv[1], shape.made);
+        return 0;
+}
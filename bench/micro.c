@@ -0,0 +1,206 @@
+/* Micro-benchmarks of fl internals, run in a folder made by bench/gen. fl.c
+ * is built in with its main renamed, and draws to /dev/null.
+ *
+ * Every folder in the working directory is expanded and collapsed, first
+ * read from disk and then from the listing cache. Then the whole tree is
+ * expanded to sort it, search it and draw it. */
+#define main fl_main
+#include "../fl.c"
+#undef main
+
+typedef DA(long long) time_da;
+
+int reps = 20;
+time_da samples = { 0 };
+
+long long
+now_ns()
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Merge what the workers post until no folder is being read */
+void
+settle()
+{
+        struct pollfd p = { .fd = posts.efd, .events = POLLIN };
+
+        while (loads.size) {
+                poll(&p, 1, 100);
+                load_process();
+        }
+}
+
+int
+time_cmp(const void *a, const void *b)
+{
+        long long x = *(const long long *) a, y = *(const long long *) b;
+        return (x > y) - (x < y);
+}
+
+/* Print the percentiles of the times taken, and the entries handled per
+ * second, items in every run */
+void
+report_times(const char *what, long long items)
+{
+        long long *t = samples.data, total = 0;
+        int i, n = samples.size;
+
+        if (!n) return;
+        for (i = 0; i < n; i++)
+                total += t[i];
+        qsort(t, n, sizeof *t, time_cmp);
+        printf("%-32.32s %9lld entries %10.0f/s  p50 %8.2f  p90 %8.2f  p99 %8.2f  max %8.2f ms\n",
+               what, items, total ? items * n / (total / 1e9) : 0.0,
+               t[n / 2] / 1e6, t[n * 9 / 10] / 1e6, t[n * 99 / 100] / 1e6, t[n - 1] / 1e6);
+        samples.size = 0;
+}
+
+void
+bench_folder(int row)
+{
+        char what[64];
+        const char *name = NAME(&ROW(row));
+        long long start, rows = 0;
+        int i, cached;
+
+        for (cached = 0; cached < 2; cached++) {
+                for (i = 0; i < reps; i++) {
+                        if (!cached)
+                                while (dircache.listings.size)
+                                        dircache_forget(0);
+                        start = now_ns();
+                        add_subfolder(row, 1);
+                        settle();
+                        da_append(&samples, now_ns() - start);
+                        rows = node_rows(ROW(row).node);
+                        remove_subfolder(row);
+                }
+                snprintf(what, sizeof what, "add_subfolder %s%s", name, cached ? " (cached)" : "");
+                report_times(what, rows);
+        }
+
+        for (i = 0; i < reps; i++) {
+                add_subfolder(row, 1);
+                settle();
+                start = now_ns();
+                remove_subfolder(row);
+                da_append(&samples, now_ns() - start);
+        }
+        snprintf(what, sizeof what, "remove_subfolder %s", name);
+        report_times(what, rows);
+}
+
+void
+bench_sort()
+{
+        static const int orders[] = { SORT_NAME, SORT_VERSION, SORT_DIRS };
+        char what[64];
+        long long start;
+        int i, k;
+
+        for (k = 0; k < (int) (sizeof orders / sizeof *orders); k++) {
+                sort_order = orders[k];
+                for (i = 0; i < reps; i++) {
+                        start = now_ns();
+                        sort();
+                        da_append(&samples, now_ns() - start);
+                }
+                snprintf(what, sizeof what, "sort %s", SORT_NAMES[sort_order]);
+                report_times(what, view.size);
+        }
+        sort_order = SORT_NAME;
+        sort();
+}
+
+/* Select the next match of pattern, as / does */
+void
+bench_search(const char *pattern)
+{
+        char what[64];
+        long long start;
+        int i;
+
+        for (i = 0; i < reps; i++) {
+                start = now_ns();
+                search_set(pattern);
+                search_next(1);
+                da_append(&samples, now_ns() - start);
+        }
+        snprintf(what, sizeof what, "search %s", pattern);
+        report_times(what, view.size);
+
+        for (i = 0; i < reps * 10; i++) {
+                start = now_ns();
+                search_next(1);
+                da_append(&samples, now_ns() - start);
+        }
+        snprintf(what, sizeof what, "search next %s", pattern);
+        report_times(what, finder.rows.size);
+}
+
+void
+bench_refresh()
+{
+        long long start;
+        int i;
+
+        selected_row = 0;
+        for (i = 0; i < reps; i++) {
+                frame.valid = 0;
+                start = now_ns();
+                refresh();
+                da_append(&samples, now_ns() - start);
+        }
+        report_times("refresh full", wsize.ws_row);
+
+        for (i = 0; i < reps * 10; i++) {
+                selected_row = (selected_row + wsize.ws_row / 2) % view.size;
+                start = now_ns();
+                refresh();
+                da_append(&samples, now_ns() - start);
+        }
+        report_times("refresh scroll", wsize.ws_row);
+}
+
+int
+main(int argc, char *argv[])
+{
+        char *value, *pattern = "9/f1.*7$";
+        int i;
+
+        flag_set(&argc, &argv);
+        if (flag_get_value(&value, "-n", "--reps")) reps = atoi(value);
+        if (flag_get_value(&value, "-p", "--pattern")) pattern = value;
+        if (argc != 2 || reps <= 0) {
+                fprintf(stderr, "usage: micro [-n reps] [-p pattern] DIR\n");
+                return 1;
+        }
+        if (chdir(argv[1])) {
+                fprintf(stderr, "micro: can not change dir to %s: %s\n", argv[1], strerror(errno));
+                return 1;
+        }
+        stdout_fileno = open("/dev/null", O_WRONLY | O_CLOEXEC);
+        wsize = (struct winsize) { .ws_row = 50, .ws_col = 120 };
+        watch.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if ((posts.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+                perror("micro: eventfd");
+                return 1;
+        }
+
+        add_root(".", 1);
+        settle();
+        for (i = 0; i < view.size; i++)
+                if (ROW(i).type == DT_DIR && strcmp(NAME(&ROW(i)), "..")) bench_folder(i);
+
+        /* Everything */
+        for (i = view.size - 1; i >= 0; i--)
+                if (ROW(i).type == DT_DIR && strcmp(NAME(&ROW(i)), "..")) add_subfolder(i, 0);
+        settle();
+        bench_sort();
+        bench_search(pattern);
+        bench_refresh();
+        return 0;
+}
@@ -1,29 +1,47 @@
+#define _GNU_SOURCE /* strverscmp, getdents64 */
+
 #include <assert.h>
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/fs.h> /* FICLONE */
+#include <linux/io_uring.h>
+#include <limits.h>
 #include <linux/limits.h>
 #include <regex.h>
 #include <semaphore.h>
+#include <poll.h>
+#include <pthread.h>
+#include <pwd.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/file.h> /* flock */
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "flag/flag.h"
 #include "frog/frog.h"
 
 #define LOG_FILE ".local/state/fl/fl.log" /* Start at HOME */
-#define UNDO_BACKUP_DIR "/tmp/fl-backup"
 
 /* Colors for specific entry types. "" is set to default */
 static const char *COLORS[] = {
@@ -37,22 +55,288 @@ static const char *COLORS[] = {
         [DT_UNKNOWN] = "",   /* The file type could not be determined. */
 };
 
-struct extend_dirent {
-        struct dirent dirent;
-        char path[256];
+#define NONE (-1)
+
+/* Timers and counters of the slow paths, shown by the overlay (S) and on
+ * exit with --stats. Build with -DSTATS=0 to leave them out. */
+#ifndef STATS
+#define STATS 1
+#endif
+
+enum {
+        PERF_READ,    /* Folder loads, from the request to the last entry */
+        PERF_SORT,
+        PERF_REFRESH,
+        PERF_SEARCH,
+        PERF_FILTER,
+        PERF_DELETE,  /* Jobs, in the order of their types */
+        PERF_RESTORE,
+        PERF_MOVE,
+        PERF_COPY,
+        PERF_PURGE,
+        PERF_OPEN,    /* Fork and exec of the editor or opener */
+        PERF_COUNT,
+};
+
+static const char *PERF_NAMES[] = {
+        [PERF_READ] = "read",
+        [PERF_SORT] = "sort",
+        [PERF_REFRESH] = "draw",
+        [PERF_SEARCH] = "search",
+        [PERF_FILTER] = "filter",
+        [PERF_DELETE] = "delete",
+        [PERF_RESTORE] = "restore",
+        [PERF_MOVE] = "move",
+        [PERF_COPY] = "copy",
+        [PERF_PURGE] = "purge",
+        [PERF_OPEN] = "open",
+};
+
+struct perf_counter {
+        long long count;
+        long long ns; /* Monotonic clock */
+        long long max_ns;
+        long long entries;
+        long long bytes;
+        long long syscalls;
+};
+
+struct {
+        int overlay; /* Shown in the status line */
+        int dump;    /* Printed on exit */
+        struct perf_counter c[PERF_COUNT];
+} perf = { 0 };
+
+/* What the uring ops of this thread count for, or NONE */
+static __thread int perf_scope = NONE;
+
+long long
+perf_now()
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Count a run of k, started at start, over entries */
+void
+perf_record(int k, long long start, long long entries)
+{
+        struct perf_counter *c = &perf.c[k];
+        long long ns = perf_now() - start, max = __atomic_load_n(&c->max_ns, __ATOMIC_RELAXED);
+
+        __atomic_add_fetch(&c->count, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&c->ns, ns, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&c->entries, entries, __ATOMIC_RELAXED);
+        while (ns > max && !__atomic_compare_exchange_n(&c->max_ns, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                ;
+}
+
+#if STATS
+#define perf_start() perf_now()
+#define perf_end(k, start, entries) perf_record(k, start, entries)
+#define perf_add(k, field, n) __atomic_add_fetch(&perf.c[k].field, n, __ATOMIC_RELAXED)
+#else
+#define perf_start() 0LL
+#define perf_end(k, start, entries) ((void) (start))
+#define perf_add(k, field, n) ((void) 0)
+#endif
+
+#if STATS
+/* Start timing the fork and exec of a child. The child inherits the write
+ * end of fds, that exec closes */
+long long
+perf_exec_start(int *fds)
+{
+        if (pipe2(fds, O_CLOEXEC)) fds[0] = fds[1] = -1;
+        return perf_now();
+}
+
+/* In the parent: wait for the child to exec (or exit) */
+void
+perf_exec_end(int *fds, long long start)
+{
+        char c;
+
+        if (fds[1] >= 0) close(fds[1]);
+        if (fds[0] >= 0) {
+                while (read(fds[0], &c, 1) < 0 && errno == EINTR)
+                        ;
+                close(fds[0]);
+        }
+        perf_record(PERF_OPEN, start, 1);
+        perf_add(PERF_OPEN, syscalls, 2);
+}
+#else
+#define perf_exec_start(fds) ((void) (fds), 0LL)
+#define perf_exec_end(fds, start) ((void) (fds), (void) (start))
+#endif
+
+/* Growable byte buffer */
+struct sbuf {
+        char *data;
+        int size;
+        int capacity;
+};
+
+/* Directory entry. Only the fields in use are kept: the name is stored in
+ * the names arena of the folder it is listed in, and the folder path is
+ * stored once in its node. */
+struct entry {
+        ino_t ino;
+        int parent;             /* Node the entry is listed in */
+        int node;               /* Node of the folder if expanded, or NONE */
+        int name;               /* Name offset in the parent names arena */
+        unsigned short namelen; /* Name length, without null termination */
+        unsigned char type;     /* d_type */
+        unsigned char marked;   /* Selected for batch operations */
+        int pos;                /* Index in the children of parent */
+        int stub;               /* Stub of the folder if evicted, or NONE */
+};
+
+typedef DA(struct entry) entry_da;
+typedef DA(int) int_da;
+typedef DA(uint32_t) u32_da;
+
+struct listing;
+
+/* Directory node. Roots and expanded folders have one, children holds the
+ * entries of the folder, sorted. */
+struct node {
+        int entry;               /* Entry of the folder, NONE for roots */
+        int fd;                  /* Open folder descriptor, or -1 */
+        char *path;              /* Folder path, shared by all its children */
+        struct sbuf names;       /* Append-only arena of null terminated names */
+        int_da children;
+        struct listing *listing; /* Listing being read into the node, if any */
+        int wd;                  /* Watch descriptor of the folder, or NONE */
+        int wnext;               /* Next node with the same watch descriptor */
+        dev_t dev;               /* Folder identity, when it was read */
+        ino_t ino;
+        long long mtime;         /* Of the folder before it was read, ns. -1 if
+                                  * the children can not be cached */
+        int rows;                /* Visible rows under it */
+        int_da open;             /* Indexes of the children expanded */
+        int_da before;           /* Rows of the ones in open before each */
+        int sums_valid;          /* before is up to date */
+        int stub;                /* Stub it is read again from, or NONE */
+};
+
+typedef DA(struct node) node_da;
+
+#define NAME(e) (nodes.data[(e)->parent].names.data + (e)->name)
+#define PATH(e) (nodes.data[(e)->parent].path)
+
+/* Entries and nodes are referenced by index. Freed slots are reused. */
+entry_da entries = { 0 };
+int_da free_entries = { 0 };
+node_da nodes = { 0 };
+int_da free_nodes = { 0 };
+int marked_count = 0;
+
+/* Folders evicted to keep under the memory budget (see memory_check) are
+ * collapsed to a stub: the identity of the folder and which of its children
+ * were expanded, by name. The folder is read again, and those children
+ * expanded again, when it comes back near the window. */
+struct stub_child {
+        int name; /* Offset in the names of the stub */
+        int stub;
+};
+
+struct stub {
+        dev_t dev;
+        ino_t ino;
+        long long mtime;
+        struct sbuf names;
+        DA(struct stub_child) children; /* Sorted by name */
+};
+
+typedef DA(struct stub) stub_da;
+
+stub_da stubs = { 0 };
+int_da free_stubs = { 0 };
+
+/* Memory budget. What the tree takes is counted from the pools, but for
+ * the names, counted as they are added and freed. */
+#define MEMORY_DEFAULT 1024 /* MiB */
+
+struct {
+        long long budget; /* Bytes, 0 for no limit */
+        long long names;  /* Capacity of the names arenas of the nodes */
+        int evicting;     /* Nodes freed are not kept in the listing cache */
+        int warned;       /* Over it with nothing left to evict */
+} memory = { .budget = (long long) MEMORY_DEFAULT << 20 };
+
+/* Metadata of the entries, by entry id too. It is read in background (see
+ * meta_fetch) */
+enum {
+        META_STALE,   /* To be read */
+        META_PENDING, /* Being read */
+        META_FRESH,
+};
+
+struct meta {
+        long long size;
+        long long mtime; /* ns */
+        unsigned mode;
+        unsigned uid;
+        unsigned gen;        /* Changes when the entry id is reused */
+        unsigned char known; /* The fields above are set */
+        unsigned char state;
+        long long tree;           /* Bytes under a folder (see tree_want) */
+        unsigned char tree_known; /* tree is set */
+        unsigned char tree_state;
+};
+
+typedef DA(struct meta) meta_da;
+
+meta_da metas = { 0 };
+
+/* Folder descriptors are kept open while expanded, so later operations can
+ * use the *at() syscalls instead of resolving whole paths again. Past
+ * max_open_dirs, folders are closed once read. */
+int open_dirs = 0;
+int max_open_dirs = 256;
+
+/* Root nodes, sorted by path */
+int_da roots = { 0 };
+
+/* Visible rows: the tree flattened, without flattening it. Every node keeps
+ * its number of rows and which children are expanded, so the entry at a row
+ * and the row of an entry are found going down or up the tree (see
+ * view_at), whatever the number of rows. */
+struct {
+        int size; /* Rows of every root */
+} view = { 0 };
+
+int view_at(int row);
+#define ROW(i) (entries.data[view_at(i)])
+
+/* Changes whenever the rows in view do */
+unsigned view_version = 0;
+
+/* Undo list. Deleted entries are kept by path as their folder may have
+ * been unloaded when restoring them. */
+struct deleted_entry {
+        char *path;
+        char *name;
+        char *trash; /* Where it is in the trash */
+        unsigned char type;
+        ino_t ino;
+        unsigned batch; /* Entries deleted together share it */
+        long long size; /* Bytes it takes in the trash */
+        struct sbuf meta; /* Of its files kept as blobs (see blob_meta) */
 };
 
-typedef DA(struct extend_dirent) dirent_da;
+typedef DA(struct deleted_entry) deleted_da;
 
-/* Entries array */
-dirent_da dir_arr = { 0 };
-dirent_da deleted_dir_arr = { 0 };
+deleted_da deleted_dir_arr = { 0 };
 
 struct winsize wsize;
 struct termios origin_termios;
+sigset_t origin_sigmask;
 int selected_row = 0;
 int woffset = 0;
-char pattern[1024] = { 0 };
 int stdout_fileno;
 
 /* Program options */
@@ -64,6 +348,40 @@ int open_as_external = 0;
 
 int do_not_delete = 0;
 
+/* Levels expanded by recursive expansion, 0 for no limit */
+int recursive_depth = 0;
+
+/* Sort orders. Names are the ones accepted by --sort */
+enum sort_order {
+        SORT_NAME,    /* By name */
+        SORT_VERSION, /* By name, numbers compared by value (natural) */
+        SORT_DIRS,    /* Folders first, then by name */
+        SORT_SIZE,    /* Largest first */
+        SORT_MTIME,   /* Newest first */
+        SORT_COUNT,
+} sort_order = SORT_NAME;
+
+static const char *SORT_NAMES[] = {
+        [SORT_NAME] = "name",
+        [SORT_VERSION] = "version",
+        [SORT_DIRS] = "dirs",
+        [SORT_SIZE] = "size",
+        [SORT_MTIME] = "mtime",
+};
+
+/* Everything sent to the terminal during a frame is appended here and
+ * written with a single write() by out_flush() */
+struct sbuf outbuf = { 0 };
+
+/* Back buffer: rows as they were sent in the last frame, so refresh() only
+ * has to send the rows that changed. */
+struct {
+        struct sbuf *rows;
+        int ws_row;
+        int ws_col;
+        int valid;
+        int cursor; /* Cursor shown at the end of the last frame */
+} frame = { 0 };
 
 char *
 __strconcat(const char *s1, ...)
@@ -71,7 +389,7 @@ __strconcat(const char *s1, ...)
         va_list ap;
         char *result;
         char *current;
-        int size = 0;
+        int size = strlen(s1);
         /* Count total size, to avoid realloc */
         va_start(ap, s1);
         while ((current = va_arg(ap, char *)))
@@ -106,6 +424,81 @@ __staticstrconcat(char *buf, int size, ...)
 #define staticstrconcat(buf, size, ...) \
         __staticstrconcat(buf, size, ##__VA_ARGS__, NULL)
 
+void
+sbuf_reserve(struct sbuf *sb, int n)
+{
+        if (sb->size + n < sb->capacity) return;
+        while (sb->size + n >= sb->capacity)
+                sb->capacity = sb->capacity ? sb->capacity * 2 : 256;
+        sb->data = realloc(sb->data, sb->capacity);
+        assert(sb->data);
+}
+
+void
+sbuf_append(struct sbuf *sb, const char *s, int n)
+{
+        sbuf_reserve(sb, n);
+        memcpy(sb->data + sb->size, s, n);
+        sb->size += n;
+}
+
+#define sbuf_puts(sb, s) sbuf_append(sb, s, strlen(s))
+
+void
+sbuf_printf(struct sbuf *sb, const char *restrict format, ...)
+{
+        va_list ap;
+        int n;
+
+        va_start(ap, format);
+        n = vsnprintf(NULL, 0, format, ap);
+        va_end(ap);
+        sbuf_reserve(sb, n + 1);
+        va_start(ap, format);
+        vsnprintf(sb->data + sb->size, n + 1, format, ap);
+        va_end(ap);
+        sb->size += n;
+}
+
+/* Write path/name of entry e to sb, null terminated */
+char *
+entry_path(struct sbuf *sb, struct entry *e)
+{
+        sb->size = 0;
+        sbuf_puts(sb, PATH(e));
+        sbuf_append(sb, "/", 1);
+        sbuf_append(sb, NAME(e), e->namelen + 1);
+        return sb->data;
+}
+
+/* Write the frame buffer to the terminal in a single syscall (retrying only
+ * on short writes) */
+void
+out_flush()
+{
+        ssize_t n;
+        int off = 0;
+
+        while (off < outbuf.size) {
+                n = write(stdout_fileno, outbuf.data + off, outbuf.size - off);
+                perf_add(PERF_REFRESH, syscalls, 1);
+                if (n < 0) {
+                        if (errno == EINTR) continue;
+                        break;
+                }
+                off += n;
+        }
+        perf_add(PERF_REFRESH, bytes, off);
+        outbuf.size = 0;
+}
+
+/* Force next refresh() to repaint every row */
+void
+invalidate_frame()
+{
+        frame.valid = 0;
+}
+
 void
 enable_raw_mode()
 {
@@ -134,8 +527,10 @@ enum {
 
 // #define DISABLE "\e[?47l"
 // #define ENABLE "\e[?47h"
-#define DISABLE "\e[?1049l"
-#define ENABLE "\e[?1049h"
+/* Autowrap is disabled while in custom mode so a long row never spills into
+ * the next one, as refresh() only repaints rows that changed. */
+#define DISABLE "\e[?7h\e[?1049l"
+#define ENABLE "\e[?1049h\e[?7l"
 // #define DISABLE ""
 // #define ENABLE ""
 
@@ -149,78 +544,333 @@ enum {
                 custom_mode_status = CUSTOM_MODE_UNSET; \
         }
 
-/* Like disable_custom_mode but does not disable alternative buffer */
-#define soft_disable_custom_mode()                      \
-        if (custom_mode_status == CUSTOM_MODE_SET) {    \
-                dprintf(stdout_fileno, "\e[?25h");      \
-                disable_raw_mode();                     \
-                custom_mode_status = CUSTOM_MODE_UNSET; \
-        }
-
 #define enable_custom_mode()                           \
         if (custom_mode_status == CUSTOM_MODE_UNSET) { \
                 enable_raw_mode();                     \
                 dprintf(stdout_fileno, "\e[?25l");     \
                 dprintf(stdout_fileno, ENABLE);        \
                 dprintf(stdout_fileno, "\e[2J\e[H");   \
+                invalidate_frame();                    \
                 custom_mode_status = CUSTOM_MODE_SET;  \
         }
 
 /* Coments in the code above are written before the actual code to be able to
  * use it inside the macro, don't judge me, please. */
 
+/* Log. Messages are formatted into a buffer that is written to LOG_FILE in
+ * batches: when it is full, and once per event loop iteration. The file is
+ * opened once, so logging in a loop does not cost a syscall per message.
+ * Levels above LOG_LEVEL are not compiled in (-DLOG_LEVEL=-1 for none), and
+ * those above logger.level are dropped. */
+enum {
+        LOG_ERROR,
+        LOG_WARN,
+        LOG_INFO,
+        LOG_DEBUG,
+};
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_DEBUG
+#endif
+
+#define LOG_BUFFER (64 * 1024)
+
+static const char *LOG_NAMES[] = {
+        [LOG_ERROR] = "error",
+        [LOG_WARN] = "warn",
+        [LOG_INFO] = "info",
+        [LOG_DEBUG] = "debug",
+};
+
+struct {
+        pthread_mutex_t lock;
+        char buf[LOG_BUFFER];
+        int size;
+        int fd;    /* -1 until opened, NONE if it can not be */
+        int level; /* Most verbose level logged */
+} logger = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .fd = -1,
+        .level = LOG_INFO,
+};
+
 int create_filename_path_if_not_exists(const char *path);
 
+/* Called with logger.lock held */
 void
-report(const char *restrict format, ...)
+log_flush_locked()
 {
-        char buffer[1024 * 1024];
-        int fd_in, fd_out;
-        char backup_filename[1024];
+        char path[1024];
+        char *home;
         ssize_t n;
-        static char *home = NULL;
+        int off;
 
-        if (home == NULL) {
+        if (!logger.size) return;
+        if (logger.fd == -1) {
                 home = getenv("HOME");
-                if (home)
-                        home = strdup(home);
-                else
-                        printf("Can not get env `HOME`");
+                staticstrconcat(path, sizeof path, home ?: ".", "/", LOG_FILE);
+                if (create_filename_path_if_not_exists(path) ||
+                    (logger.fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644)) < 0)
+                        logger.fd = NONE;
         }
+        for (off = 0; logger.fd >= 0 && off < logger.size; off += n)
+                if ((n = write(logger.fd, logger.buf + off, logger.size - off)) <= 0) break;
+        logger.size = 0;
+}
 
-        staticstrconcat(backup_filename, 1024, home ?: ".", "/", LOG_FILE);
-        if (create_filename_path_if_not_exists(backup_filename)) {
-                printf("Can not create path for file: `%s`", backup_filename);
-                return;
-        }
+/* Write the messages buffered */
+void
+log_flush()
+{
+        pthread_mutex_lock(&logger.lock);
+        log_flush_locked();
+        pthread_mutex_unlock(&logger.lock);
+}
 
-        FILE *file = fopen(backup_filename, "a");
+void
+log_write(int level, const char *restrict format, ...)
+{
         va_list ap;
-        va_start(ap, format);
-        vfprintf(file, format, ap);
-        fprintf(file, "\n");
-        fclose(file);
-        va_end(ap);
+        int n, room, start;
+
+        if (level > logger.level) return;
+        pthread_mutex_lock(&logger.lock);
+        for (;;) {
+                start = logger.size;
+                room = LOG_BUFFER - start - 1; /* For the new line */
+                n = snprintf(logger.buf + start, room, "%s: ", LOG_NAMES[level]);
+                if (n > room) n = room;
+                va_start(ap, format);
+                n += vsnprintf(logger.buf + start + n, room - n, format, ap);
+                va_end(ap);
+                if (n < room || !start) break;
+                /* It does not fit: write the others first */
+                logger.size = start;
+                log_flush_locked();
+        }
+        /* Longer than the buffer: cut */
+        logger.size = n < room ? start + n : start + room - 1;
+        logger.buf[logger.size++] = '\n';
+        pthread_mutex_unlock(&logger.lock);
 }
 
+#define log_at(level, ...)                                         \
+        do {                                                       \
+                if ((level) <= LOG_LEVEL) log_write(level, __VA_ARGS__); \
+        } while (0)
+
+#define report(...) log_at(LOG_ERROR, __VA_ARGS__)
+#define warn(...) log_at(LOG_WARN, __VA_ARGS__)
+#define info(...) log_at(LOG_INFO, __VA_ARGS__)
+#define debug(...) log_at(LOG_DEBUG, __VA_ARGS__)
+
 /* f must be string literal */
 #define error(f, ...) report(f ": %s", ##__VA_ARGS__, strerror(errno));
 
+/* Lists with at least this many entries are sorted by several threads */
+#define PARALLEL_SORT_MIN (1 << 16)
+#define SORT_THREADS_MAX 8
+
+/* Sort key, computed once per entry before sorting. name points into the
+ * folder names arena, so comparing keys never copies anything. */
+struct sort_key {
+        long long key;
+        const char *name;
+        int entry;
+};
+
+typedef DA(struct sort_key) sort_key_da;
+
+int is_folder(struct entry *entry);
+
+int node_dirfd(int n);
+void node_dirfd_done(int n, int fd);
+void node_touch(int n);
+void meta_want(int e);
+
+/* Entries are only stat while sorted in batch mode. In the view, sorting
+ * never waits for the filesystem: entries whose metadata is not known get
+ * a neutral key, and their folder is sorted again once it is read (see
+ * meta_process) */
+int sort_stat = 0;
+
+/* Folder of node n if the sort order needs to stat entries, -1 otherwise.
+ * Release it with node_dirfd_done() */
+int
+sort_dirfd(int n)
+{
+        if (!sort_stat || (sort_order != SORT_SIZE && sort_order != SORT_MTIME)) return -1;
+        return node_dirfd(n);
+}
+
+/* Metadata of entry e, reached as name from dirfd. Return 0 if it is not
+ * known */
+int
+sort_meta(int e, int dirfd, const char *name)
+{
+        struct meta *m = &metas.data[e];
+        struct stat st;
+
+        if (m->known && m->state == META_FRESH) return 1;
+        if (!sort_stat) {
+                meta_want(e);
+                return m->known;
+        }
+        if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW)) return 0;
+        m->size = st.st_size;
+        m->mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+        m->mode = st.st_mode;
+        m->uid = st.st_uid;
+        m->known = 1;
+        if (m->state == META_STALE) m->state = META_FRESH;
+        return 1;
+}
+
+void
+sort_key(struct sort_key *k, int e, int dirfd)
+{
+        struct entry *entry = &entries.data[e];
+
+        k->key = 0;
+        k->name = NAME(entry);
+        k->entry = e;
+
+        switch (sort_order) {
+        case SORT_DIRS:
+                k->key = !is_folder(entry);
+                break;
+        case SORT_SIZE:
+                if (sort_meta(e, dirfd, k->name))
+                        k->key = -metas.data[e].size;
+                break;
+        case SORT_MTIME:
+                if (sort_meta(e, dirfd, k->name))
+                        k->key = -metas.data[e].mtime;
+                break;
+        default:
+                break;
+        }
+}
+
 int
 sort_cmp(const void *_a, const void *_b)
 {
-        struct extend_dirent *a = (struct extend_dirent *) _a;
-        struct extend_dirent *b = (struct extend_dirent *) _b;
-        char fullpath_a[1024], fullpath_b[1024];
-        return strcmp(
-        staticstrconcat(fullpath_a, 1024, a->path, "/", a->dirent.d_name),
-        staticstrconcat(fullpath_b, 1024, b->path, "/", b->dirent.d_name));
+        const struct sort_key *a = _a;
+        const struct sort_key *b = _b;
+
+        if (a->key != b->key) return a->key < b->key ? -1 : 1;
+        if (sort_order == SORT_VERSION) return strverscmp(a->name, b->name);
+        return strcmp(a->name, b->name);
+}
+
+struct sort_chunk {
+        struct sort_key *data;
+        int size;
+        pthread_t thread;
+        int running;
+};
+
+void *
+sort_chunk(void *arg)
+{
+        struct sort_chunk *chunk = arg;
+        qsort(chunk->data, chunk->size, sizeof *chunk->data, sort_cmp);
+        return NULL;
+}
+
+/* Merge sorted runs a[lo, mid) and a[mid, hi) into out */
+void
+sort_merge(struct sort_key *a, int lo, int mid, int hi, struct sort_key *out)
+{
+        int i = lo, j = mid, k = lo;
+        while (i < mid && j < hi)
+                out[k++] = sort_cmp(&a[j], &a[i]) < 0 ? a[j++] : a[i++];
+        memcpy(out + k, a + i, (mid - i) * sizeof *a);
+        k += mid - i;
+        memcpy(out + k, a + j, (hi - j) * sizeof *a);
+}
+
+/* Sort keys. Large lists are split in chunks sorted by one thread each and
+ * then merged. */
+void
+sort_keys(struct sort_key *keys, int size)
+{
+        struct sort_chunk chunks[SORT_THREADS_MAX];
+        int bounds[SORT_THREADS_MAX + 1];
+        struct sort_key *tmp, *src, *dst, *swap;
+        int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+        int i, runs, step;
+
+        if (nthreads > SORT_THREADS_MAX) nthreads = SORT_THREADS_MAX;
+        if (size < PARALLEL_SORT_MIN || nthreads < 2 ||
+            !(tmp = malloc(size * sizeof *keys))) {
+                qsort(keys, size, sizeof *keys, sort_cmp);
+                return;
+        }
+
+        for (i = 0; i <= nthreads; i++)
+                bounds[i] = (long long) size * i / nthreads;
+        for (i = 0; i < nthreads; i++) {
+                chunks[i].data = keys + bounds[i];
+                chunks[i].size = bounds[i + 1] - bounds[i];
+                chunks[i].running = !pthread_create(&chunks[i].thread, NULL,
+                                                    sort_chunk, &chunks[i]);
+                if (!chunks[i].running) sort_chunk(&chunks[i]);
+        }
+        for (i = 0; i < nthreads; i++)
+                if (chunks[i].running) pthread_join(chunks[i].thread, NULL);
+
+        src = keys;
+        dst = tmp;
+        for (runs = nthreads, step = 1; runs > 1; runs = (runs + 1) / 2, step *= 2) {
+                for (i = 0; i < nthreads; i += 2 * step) {
+                        if (i + step >= nthreads)
+                                memcpy(dst + bounds[i], src + bounds[i],
+                                       (bounds[nthreads] - bounds[i]) * sizeof *src);
+                        else
+                                sort_merge(src, bounds[i], bounds[i + step],
+                                           bounds[i + 2 * step < nthreads ? i + 2 * step : nthreads],
+                                           dst);
+                }
+                swap = src;
+                src = dst;
+                dst = swap;
+        }
+        if (src != keys) memcpy(keys, src, size * sizeof *keys);
+        free(tmp);
+}
+
+/* Sort the children of node n. Keys are computed once per entry. */
+void
+sort_node(int n)
+{
+        static sort_key_da keys = { 0 };
+        int_da *children = &nodes.data[n].children;
+        int i, dirfd = sort_dirfd(n);
+
+        keys.size = 0;
+        for (i = 0; i < children->size; i++) {
+                da_append(&keys, (struct sort_key) { 0 });
+                sort_key(&keys.data[i], children->data[i], dirfd);
+        }
+        node_dirfd_done(n, dirfd);
+
+        sort_keys(keys.data, keys.size);
+        for (i = 0; i < children->size; i++)
+                children->data[i] = keys.data[i].entry;
+        node_touch(n);
 }
 
+/* Sort every loaded folder */
 void
 sort()
 {
-        qsort(dir_arr.data, dir_arr.size, sizeof *dir_arr.data, sort_cmp);
+        long long start = perf_start();
+        int i;
+
+        for (i = 0; i < nodes.size; i++)
+                if (nodes.data[i].path) sort_node(i);
+        perf_end(PERF_SORT, start, view.size);
 }
 
 int
@@ -233,10 +883,9 @@ void
 edit_file(const char *path, const char *subpath)
 {
         static char *editor = NULL;
-        int child;
-        char buf[1024];
-        char *p = subpath ? staticstrconcat(buf, 1024, subpath, "/", path) :
-                            strncpy(buf, path, 1024);
+        long long start;
+        int child, fds[2];
+        char *p = subpath ? strconcat(subpath, "/", path) : strdup(path);
 
         if (!p) {
                 error("Critical error: can not alloc memory");
@@ -246,31 +895,43 @@ edit_file(const char *path, const char *subpath)
         /* Todo: filter by extension, as some files should be opened allways
          * externally. */
         if (open_as_external || endwith(p, ".pdf")) {
+                log_flush();
+                start = perf_exec_start(fds);
                 switch (fork()) {
                 case -1:
+                        perf_exec_end(fds, start);
                         error("Fork failed");
+                        free(p);
                         return;
                 case 0:
                         setsid();
+                        sigprocmask(SIG_SETMASK, &origin_sigmask, NULL);
                         execvp("xdg-open",
                                (char *const[]) { "xdg-open", p, NULL });
                         error("Execv failed");
                         report("  at: execv(\"xdg-open\", (char *const[]) "
                                "{ \"xdg-open\", %s, NULL });",
                                p);
+                        log_flush();
                         abort();
                 default:
+                        perf_exec_end(fds, start);
+                        free(p);
                         return;
                 }
         }
 
         disable_custom_mode();
+        log_flush();
 
+        start = perf_exec_start(fds);
         switch (child = fork()) {
         case -1:
+                perf_exec_end(fds, start);
                 error("Fork failed");
                 break;
         case 0:
+                sigprocmask(SIG_SETMASK, &origin_sigmask, NULL);
                 if (!editor) editor = getenv("EDITOR");
                 if (!editor) {
                         error("Can not find env `EDITOR`");
@@ -283,487 +944,6977 @@ edit_file(const char *path, const char *subpath)
                 error("Execv failed");
                 report("  at: execv(%s, (char *const[]) { %s, %s, NULL });",
                        editor, p, editor);
+                log_flush();
                 abort();
 
         default:
+                perf_exec_end(fds, start);
                 waitpid(child, NULL, 0);
                 break;
         }
 
+        free(p);
         enable_custom_mode();
 }
 
-/* Add path from subpath path, at list index at. subpath can be null if using
- * current dir, and at can be -1 to append it. */
-void
-add_subfolder(const char *path, const char *subpath, int at)
+int
+entry_new()
 {
-        struct dirent *entry;
-        struct extend_dirent edirent;
-        char *p;
-        DIR *dir;
-
-        p = subpath ? strconcat(subpath, "/", path) :
-                      strdup(path);
+        struct entry e = { .parent = NONE, .node = NONE, .stub = NONE };
+        int id;
 
-        if (!(dir = opendir(p))) {
-                error("Can not open dir: %s", path);
-                return;
+        if (free_entries.size) {
+                id = free_entries.data[--free_entries.size];
+                entries.data[id] = e;
+        } else {
+                da_append(&entries, e);
+                da_append(&metas, (struct meta) { 0 });
+                id = entries.size - 1;
         }
-        if (at < 0 || at > dir_arr.size) at = dir_arr.size;
+        metas.data[id] = (struct meta) { .gen = metas.data[id].gen + 1 };
+        return id;
+}
 
-        while ((entry = readdir(dir))) {
-                if (!strcmp(entry->d_name, ".")) continue; // do not add "^./"
-                edirent.dirent = *entry;
-                strcpy(edirent.path, p);
-                da_insert(&dir_arr, edirent, at);
-        }
+/* Free stub s and the ones of its children */
+void
+stub_free(int s)
+{
+        int i;
 
-        free(p);
-        sort();
+        for (i = 0; i < stubs.data[s].children.size; i++)
+                if (stubs.data[s].children.data[i].stub != NONE) stub_free(stubs.data[s].children.data[i].stub);
+        free(stubs.data[s].names.data);
+        free(stubs.data[s].children.data);
+        stubs.data[s] = (struct stub) { 0 };
+        da_append(&free_stubs, s);
 }
 
 void
-remove_subfolder(const char *path, const char *subpath)
+entry_free(int e)
 {
-        int i;
-        char *p;
+        if (entries.data[e].stub != NONE) stub_free(entries.data[e].stub);
+        entries.data[e].stub = NONE;
+        if (entries.data[e].marked) --marked_count;
+        entries.data[e].marked = 0;
+        entries.data[e].parent = NONE;
+        da_append(&free_entries, e);
+}
 
-        p = subpath ? strconcat(subpath, "/", path) :
-                      strdup(path);
+/* Folder watches. Every node is watched with inotify from its creation, so
+ * nothing done while it is read is missed. Changes are applied some time
+ * after the first one is read, so a burst of them updates each folder once.
+ * The same folder can be listed by several nodes, and they share its watch
+ * descriptor. */
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                    IN_ATTRIB | IN_CLOSE_WRITE | IN_ONLYDIR | IN_EXCL_UNLINK)
+#define WATCH_DELAY_MS 100
 
-        for (i = 0; i < dir_arr.size; i++) {
-                if (!memcmp(p, dir_arr.data[i].path, strlen(p))) {
-                        da_remove(&dir_arr, i);
-                        --i;
-                }
-        }
-        free(p);
+struct change {
+        int wd;
+        int name;  /* Offset in the watch names arena */
+        int add;   /* Created or moved in, else deleted or moved out */
+        int attr;  /* Only its metadata or data changed */
+        int seq;   /* Order in which it was read */
+        int entry; /* Child with that name, found when applying it */
+};
+
+typedef DA(struct change) change_da;
+
+struct {
+        int fd;
+        int_da nodes; /* First node of each watch descriptor, or NONE */
+        change_da changes;
+        struct sbuf names;
+        long long deadline; /* When changes are applied, in ms, or 0 */
+        int full;           /* The watch limit was reached and reported */
+        int overflow;       /* Some events were lost */
+} watch = { .fd = -1 };
+
+long long
+now_ms()
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
 }
 
-int
-is_folder_open(const char *path, const char *subpath)
+void
+watch_add(int n)
 {
-        char *p;
-        int i;
+        int wd;
 
-        p = subpath ? strconcat(subpath, "/", path) :
-                      strdup(path);
-        for (i = 0; i < dir_arr.size; i++) {
-                if (!memcmp(p, dir_arr.data[i].path, strlen(p))) {
-                        return 1;
+        if (watch.fd < 0) return;
+        if ((wd = inotify_add_watch(watch.fd, nodes.data[n].path, WATCH_MASK)) < 0) {
+                /* Folders that can not be read are reported when loading */
+                if (errno == ENOSPC && !watch.full) {
+                        warn("Folder watch limit reached: new folders are not watched");
+                        watch.full = 1;
                 }
+                return;
         }
-        free(p);
-        return 0;
+        while (watch.nodes.size <= wd)
+                da_append(&watch.nodes, NONE);
+        nodes.data[n].wd = wd;
+        nodes.data[n].wnext = watch.nodes.data[wd];
+        watch.nodes.data[wd] = n;
 }
 
 void
-print_file(struct extend_dirent entry)
+watch_remove(int n)
 {
-        char *path = entry.path;
-        if (!memcmp(path, "./", 2)) path += 2; // remove the ugly ./ prefix
-        if (strcmp(path, ".")) dprintf(stdout_fileno, "%s/", path);
-        dprintf(stdout_fileno, "%s%s\e[0m\n",
-                COLORS[entry.dirent.d_type], entry.dirent.d_name);
+        int *p, wd = nodes.data[n].wd;
+
+        if (wd == NONE) return;
+        for (p = &watch.nodes.data[wd]; *p != n; p = &nodes.data[*p].wnext)
+                ;
+        *p = nodes.data[n].wnext;
+        if (watch.nodes.data[wd] == NONE) inotify_rm_watch(watch.fd, wd);
+        nodes.data[n].wd = NONE;
 }
 
-void
-calc_wsize(int _)
+int
+node_new(int entry, const char *path)
 {
-        /* To be called on SIGWINCH */
-        ioctl(0, TIOCGWINSZ, &wsize);
+        struct node node = { .entry = entry, .fd = -1, .path = strdup(path), .wd = NONE, .mtime = -1, .stub = NONE };
+        int n;
+        if (free_nodes.size) {
+                n = free_nodes.data[--free_nodes.size];
+                nodes.data[n] = node;
+        } else {
+                da_append(&nodes, node);
+                n = nodes.size - 1;
+        }
+        watch_add(n);
+        return n;
 }
 
+void listing_drop(struct listing *l);
+void dircache_save(int n);
+void node_detach(int n);
+
+/* Free node n and everything loaded under it, whose rows go with it */
 void
-refresh()
+node_release(int n)
 {
-        int i;
-        /* I don't know how this work, just assume calcs are right */
-        int ws = (wsize.ws_row - 1 < dir_arr.size) ? wsize.ws_row - 1 :
-                                                     dir_arr.size;
-
-        if (selected_row < woffset) woffset = selected_row;
-        if (selected_row >= woffset + ws) woffset = selected_row - ws + 1;
-
-        dprintf(stdout_fileno, "\e[2J\e[H");
-        for (i = woffset; i < ws + woffset; i++) {
-                if (i == selected_row) dprintf(stdout_fileno, "\e[7m");
-                print_file(dir_arr.data[i]);
+        int i, e;
+        dircache_save(n);
+        for (i = 0; i < nodes.data[n].children.size; i++) {
+                e = nodes.data[n].children.data[i];
+                if (entries.data[e].node != NONE) node_release(entries.data[e].node);
+                entry_free(e);
         }
-        fsync(stdout_fileno);
+        if (nodes.data[n].entry != NONE)
+                entries.data[nodes.data[n].entry].node = NONE;
+        if (nodes.data[n].listing) listing_drop(nodes.data[n].listing);
+        if (nodes.data[n].stub != NONE) stub_free(nodes.data[n].stub);
+        watch_remove(n);
+        if (nodes.data[n].fd >= 0) {
+                close(nodes.data[n].fd);
+                __atomic_sub_fetch(&open_dirs, 1, __ATOMIC_ACQ_REL);
+        }
+        free(nodes.data[n].children.data);
+        memory.names -= nodes.data[n].names.capacity;
+        free(nodes.data[n].names.data);
+        free(nodes.data[n].path);
+        free(nodes.data[n].open.data);
+        free(nodes.data[n].before.data);
+        nodes.data[n] = (struct node) { .entry = NONE };
+        da_append(&free_nodes, n);
 }
 
-int
-getkey()
+/* Free node n and everything loaded under it. Its children are kept in the
+ * listing cache */
+void
+node_free(int n)
+{
+        node_detach(n);
+        node_release(n);
+}
+
+/* Number of visible rows under node n */
+int
+node_rows(int n)
+{
+        return nodes.data[n].rows;
+}
+
+/* Write the visible rows under node n to out. Return the number of rows */
+int
+node_flatten(int n, int *out)
+{
+        int i, e, rows = 0;
+        for (i = 0; i < nodes.data[n].children.size; i++) {
+                e = nodes.data[n].children.data[i];
+                out[rows++] = e;
+                if (entries.data[e].node != NONE)
+                        rows += node_flatten(entries.data[e].node, out + rows);
+        }
+        return rows;
+}
+
+/* Add d rows to node n and to the nodes holding it */
+void
+node_rows_add(int n, int d)
+{
+        int e;
+
+        if (!d) return;
+        for (;;) {
+                nodes.data[n].rows += d;
+                nodes.data[n].sums_valid = 0;
+                if ((e = nodes.data[n].entry) == NONE) break;
+                n = entries.data[e].parent;
+        }
+        view.size += d;
+}
+
+/* Children of node n changed: number them again, and count its rows again */
+void
+node_reindex(int n)
+{
+        struct node *node = &nodes.data[n];
+        int i, e, rows = node->children.size;
+
+        node->open.size = 0;
+        for (i = 0; i < node->children.size; i++) {
+                e = node->children.data[i];
+                entries.data[e].pos = i;
+                if (entries.data[e].node != NONE) {
+                        da_append(&node->open, i);
+                        rows += nodes.data[entries.data[e].node].rows;
+                }
+        }
+        node->sums_valid = 0;
+        view_version++;
+        node_rows_add(n, rows - node->rows);
+}
+
+/* Index in node->open of the first child expanded at or after child k */
+int
+node_open_index(struct node *node, int k)
+{
+        int lo = 0, hi = node->open.size, mid;
+
+        while (lo < hi) {
+                mid = (lo + hi) / 2;
+                if (node->open.data[mid] < k)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        return lo;
+}
+
+/* Rows of the expanded children of node before each of them, and of all of
+ * them last */
+void
+node_sums(struct node *node)
+{
+        int i, sum = 0;
+
+        if (node->sums_valid) return;
+        node->before.size = 0;
+        for (i = 0; i < node->open.size; i++) {
+                da_append(&node->before, sum);
+                sum += nodes.data[entries.data[node->children.data[node->open.data[i]]].node].rows;
+        }
+        da_append(&node->before, sum);
+        node->sums_valid = 1;
+}
+
+/* Show node n under its folder entry e */
+void
+node_attach(int e, int n)
+{
+        int p = entries.data[e].parent, k = entries.data[e].pos;
+
+        entries.data[e].node = n;
+        da_insert(&nodes.data[p].open, k, node_open_index(&nodes.data[p], k));
+        view_version++;
+        node_rows_add(p, nodes.data[n].rows);
+        nodes.data[p].sums_valid = 0;
+}
+
+/* Node n is going to be freed: its rows leave the view */
+void
+node_detach(int n)
+{
+        int p, e = nodes.data[n].entry;
+
+        view_version++;
+        if (e == NONE) {
+                view.size -= nodes.data[n].rows;
+                return;
+        }
+        p = entries.data[e].parent;
+        da_remove(&nodes.data[p].open, node_open_index(&nodes.data[p], entries.data[e].pos));
+        node_rows_add(p, -nodes.data[n].rows);
+        nodes.data[p].sums_valid = 0;
+}
+
+/* Entry at row. The tree is walked down from the root holding it, with a
+ * binary search of the expanded children of every folder on the way */
+int
+view_at(int row)
+{
+        struct node *node;
+        int i, k, e, sub, lo, hi, mid;
+
+        for (i = 0; i < roots.size - 1 && row >= nodes.data[roots.data[i]].rows; i++)
+                row -= nodes.data[roots.data[i]].rows;
+        node = &nodes.data[roots.data[i]];
+        for (;;) {
+                node_sums(node);
+                /* Last child expanded at or before row */
+                lo = 0;
+                hi = node->open.size;
+                while (lo < hi) {
+                        mid = (lo + hi) / 2;
+                        if (node->open.data[mid] + node->before.data[mid] <= row)
+                                lo = mid + 1;
+                        else
+                                hi = mid;
+                }
+                if (!lo) return node->children.data[row];
+
+                k = node->open.data[lo - 1];
+                row -= k + node->before.data[lo - 1];
+                e = node->children.data[k];
+                sub = entries.data[e].node;
+                if (!row) return e;
+                if (row > nodes.data[sub].rows) return node->children.data[k + row - nodes.data[sub].rows];
+                node = &nodes.data[sub];
+                row--;
+        }
+}
+
+/* Row of entry e, walking the tree up */
+int
+entry_row(int e)
+{
+        struct node *node;
+        int i, k, n, row = 0;
+
+        for (;;) {
+                n = entries.data[e].parent;
+                node = &nodes.data[n];
+                node_sums(node);
+                k = entries.data[e].pos;
+                row += k + node->before.data[node_open_index(node, k)];
+                if ((e = node->entry) == NONE) break;
+                row++;
+        }
+        for (i = 0; i < roots.size && roots.data[i] != n; i++)
+                row += nodes.data[roots.data[i]].rows;
+        return row;
+}
+
+/* Row where the children of node n start */
+int
+node_row(int n)
+{
+        int i, row = 0;
+
+        if (nodes.data[n].entry != NONE) return entry_row(nodes.data[n].entry) + 1;
+        for (i = 0; i < roots.size && roots.data[i] != n; i++)
+                row += nodes.data[roots.data[i]].rows;
+        return row;
+}
+
+/* Every row, as entries, for the passes over the whole view. It is
+ * flattened again only when the view changed. */
+int *
+view_rows()
+{
+        static int_da flat = { 0 };
+        static unsigned version = 0;
+        static int valid = 0;
+        int i, rows = 0;
+
+        if (valid && version == view_version) return flat.data;
+        while (flat.size < view.size)
+                da_append(&flat, 0);
+        flat.size = view.size;
+        for (i = 0; i < roots.size; i++)
+                rows += node_flatten(roots.data[i], flat.data + rows);
+        version = view_version;
+        valid = 1;
+        return flat.data;
+}
+
+/* Where node n was in view before its children changed */
+struct view_span {
+        int start;
+        int rows;
+        int sel; /* Entry selected, if it was one of the rows */
+};
+
+struct view_span
+view_span(int n)
+{
+        struct view_span s = { .start = node_row(n), .rows = nodes.data[n].rows, .sel = NONE };
+
+        if (selected_row >= s.start && selected_row < s.start + s.rows) s.sel = view_at(selected_row);
+        return s;
+}
+
+/* Children of node n changed since old: the selection and the window stay
+ * on the same entries. */
+void
+view_update_node(int n, const struct view_span *old)
+{
+        int rows = nodes.data[n].rows;
+
+        if (selected_row >= old->start + old->rows)
+                selected_row += rows - old->rows;
+        else if (old->sel != NONE)
+                selected_row = entries.data[old->sel].parent != NONE ? entry_row(old->sel) : old->start;
+        if (selected_row >= view.size) selected_row = view.size ? view.size - 1 : 0;
+        if (woffset > old->start) {
+                woffset += rows - old->rows;
+                if (woffset < old->start) woffset = old->start;
+        }
+}
+
+/* Append n bytes of s to the names of node, counting them */
+void
+node_names_append(struct node *node, const char *s, int n)
+{
+        memory.names -= node->names.capacity;
+        sbuf_append(&node->names, s, n);
+        memory.names += node->names.capacity;
+}
+
+/* Create an entry listed in node n. It is not linked in the children list */
+int
+entry_add(int n, const char *name, int namelen, int type, ino_t ino)
+{
+        int e = entry_new();
+        struct node *node = &nodes.data[n];
+
+        entries.data[e].ino = ino;
+        entries.data[e].parent = n;
+        entries.data[e].name = node->names.size;
+        entries.data[e].namelen = namelen;
+        entries.data[e].type = type;
+        node_names_append(node, name, namelen + 1);
+        return e;
+}
+
+/* Descriptor and name to reach entry e with the *at() syscalls. If its
+ * folder is not kept open, the full path is written to sb and used instead. */
+int
+entry_at(struct entry *e, struct sbuf *sb, const char **name)
+{
+        int fd = nodes.data[e->parent].fd;
+        if (fd >= 0) {
+                *name = NAME(e);
+                return fd;
+        }
+        *name = entry_path(sb, e);
+        return AT_FDCWD;
+}
+
+/* Descriptor of the folder of node n, opened by path if it is not kept
+ * open. Release it with node_dirfd_done() */
+int
+node_dirfd(int n)
+{
+        if (nodes.data[n].fd >= 0) return nodes.data[n].fd;
+        return open(nodes.data[n].path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+void
+node_dirfd_done(int n, int fd)
+{
+        if (fd >= 0 && fd != nodes.data[n].fd) close(fd);
+}
+
+/* Work-stealing thread pool. Every worker pops tasks from the back of its
+ * own queue, and steals from the front of the others when it is empty. Tasks
+ * submitted by a worker go to its own queue. */
+struct task_group {
+        int pending; /* Tasks submitted and not finished yet */
+};
+
+struct task {
+        void (*fn)(void *arg);
+        void *arg;
+        struct task_group *group;
+};
+
+typedef DA(struct task) task_da;
+
+struct task_queue {
+        pthread_mutex_t lock;
+        task_da tasks;
+        int head;
+};
+
+#define POOL_WORKERS_MIN 4
+#define POOL_WORKERS_MAX 32
+
+struct {
+        pthread_mutex_t lock;
+        pthread_cond_t wake; /* Signaled when a task is queued */
+        pthread_cond_t done; /* Broadcast when a group finishes */
+        struct task_queue *queues;
+        int nworkers; /* Number of queues */
+        int nthreads; /* Number of workers running */
+        int queued;   /* Tasks in the queues */
+        int next;   /* Queue for tasks submitted from outside the pool */
+} pool = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .wake = PTHREAD_COND_INITIALIZER,
+        .done = PTHREAD_COND_INITIALIZER,
+};
+
+static __thread int worker_id = NONE;
+
+int
+queue_pop(struct task_queue *q, struct task *t, int steal)
+{
+        int found = 0;
+
+        pthread_mutex_lock(&q->lock);
+        if (q->head < q->tasks.size) {
+                *t = steal ? q->tasks.data[q->head++] :
+                             q->tasks.data[--q->tasks.size];
+                if (q->head == q->tasks.size) q->head = q->tasks.size = 0;
+                found = 1;
+        }
+        pthread_mutex_unlock(&q->lock);
+        return found;
+}
+
+void
+task_run(struct task *t)
+{
+        t->fn(t->arg);
+        if (__atomic_sub_fetch(&t->group->pending, 1, __ATOMIC_ACQ_REL)) return;
+        pthread_mutex_lock(&pool.lock);
+        pthread_cond_broadcast(&pool.done);
+        pthread_mutex_unlock(&pool.lock);
+}
+
+void *
+pool_worker(void *arg)
+{
+        struct task t;
+        int i;
+
+        worker_id = (long) arg;
+        for (;;) {
+                for (i = 0; i < pool.nworkers; i++)
+                        if (queue_pop(&pool.queues[(worker_id + i) % pool.nworkers],
+                                      &t, i > 0))
+                                break;
+
+                if (i < pool.nworkers) {
+                        __atomic_sub_fetch(&pool.queued, 1, __ATOMIC_ACQ_REL);
+                        task_run(&t);
+                        continue;
+                }
+
+                pthread_mutex_lock(&pool.lock);
+                while (!__atomic_load_n(&pool.queued, __ATOMIC_ACQUIRE))
+                        pthread_cond_wait(&pool.wake, &pool.lock);
+                pthread_mutex_unlock(&pool.lock);
+        }
+        return NULL;
+}
+
+void
+pool_init()
+{
+        pthread_t thread;
+        long i, n;
+
+        if (pool.queues) return;
+
+        /* Folder reads are latency bound, so use more workers than cores */
+        n = sysconf(_SC_NPROCESSORS_ONLN) * 2;
+        if (n < POOL_WORKERS_MIN) n = POOL_WORKERS_MIN;
+        if (n > POOL_WORKERS_MAX) n = POOL_WORKERS_MAX;
+
+        pool.queues = calloc(n, sizeof *pool.queues);
+        assert(pool.queues);
+        for (i = 0; i < n; i++)
+                pthread_mutex_init(&pool.queues[i].lock, NULL);
+        pool.nworkers = n;
+        /* Queues without a thread are still drained by stealing */
+        for (i = 0; i < n; i++) {
+                if (pthread_create(&thread, NULL, pool_worker, (void *) i)) {
+                        error("Can not create worker thread");
+                        break;
+                }
+                pthread_detach(thread);
+                pool.nthreads++;
+        }
+}
+
+/* Run fn(arg) in the pool, as part of group. If there are no workers it is
+ * run right away. */
+void
+pool_submit(struct task_group *group, void (*fn)(void *), void *arg)
+{
+        struct task t = { fn, arg, group };
+        struct task_queue *q;
+
+        pool_init();
+        __atomic_add_fetch(&group->pending, 1, __ATOMIC_ACQ_REL);
+        if (pool.nthreads == 0) {
+                task_run(&t);
+                return;
+        }
+
+        q = &pool.queues[worker_id != NONE ?
+                         worker_id :
+                         __atomic_fetch_add(&pool.next, 1, __ATOMIC_RELAXED) % pool.nworkers];
+        __atomic_add_fetch(&pool.queued, 1, __ATOMIC_ACQ_REL);
+        pthread_mutex_lock(&q->lock);
+        da_append(&q->tasks, t);
+        pthread_mutex_unlock(&q->lock);
+
+        pthread_mutex_lock(&pool.lock);
+        pthread_cond_signal(&pool.wake);
+        pthread_mutex_unlock(&pool.lock);
+}
+
+/* Wait until every task of group is finished */
+void
+group_wait(struct task_group *group)
+{
+        pthread_mutex_lock(&pool.lock);
+        while (__atomic_load_n(&group->pending, __ATOMIC_ACQUIRE))
+                pthread_cond_wait(&pool.done, &pool.lock);
+        pthread_mutex_unlock(&pool.lock);
+}
+
+/* Folders are read by the pool and their entries posted to the main thread
+ * in batches, which merges them in the tree as they arrive. The UI never
+ * waits for a folder to be read. */
+
+/* Read buffer size. Entries are read in batches of this many bytes */
+#define GETDENTS_BUF_SIZE (256 * 1024)
+
+/* Entries posted per batch. It doubles after every batch of a folder, so the
+ * first screen shows up quickly and large folders are merged a few times */
+#define BATCH_MIN 1024
+#define BATCH_MAX (256 * 1024)
+
+/* A listing is only cached if the folder mtime is older than this when it
+ * is read: a file created in the same clock tick could leave it unchanged */
+#define DIRCACHE_RACY_NS 1000000000LL
+
+/* Mtime of folder st, in ns, to validate a listing read after it. -1 if it
+ * is too recent to tell later changes */
+long long
+dir_stamp(struct stat *st)
+{
+        struct timespec now;
+        long long mtime = st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+
+        clock_gettime(CLOCK_REALTIME, &now);
+        if (now.tv_sec * 1000000000LL + now.tv_nsec - mtime < DIRCACHE_RACY_NS) return -1;
+        return mtime;
+}
+
+/* Load of a folder, with its subfolders up to depth levels */
+struct load {
+        int cancel; /* Stop reading */
+        int active; /* Listings not finished yet */
+        int depth;  /* 0 for no limit */
+        long long start; /* See perf_start */
+        pthread_mutex_t lock;
+        DA(struct listing *) listings; /* Freed with the load */
+};
+
+typedef DA(struct load *) load_da;
+
+struct task_group load_group = { 0 };
+
+/* Loads in progress, used by the main thread only */
+load_da loads = { 0 };
+
+/* Entry as read by a worker */
+struct raw_entry {
+        ino_t ino;
+        int name; /* Offset in the batch names */
+        unsigned short namelen;
+        unsigned char type;
+};
+
+typedef DA(struct raw_entry) raw_entry_da;
+
+/* Folder being read. Workers only touch the first group of fields, the main
+ * thread the second one. */
+struct listing {
+        struct load *load;
+        struct listing *parent; /* Listing of the parent folder */
+        char *name;             /* Folder name, relative to dirfd or parent->fd */
+        int dirfd;              /* Owned descriptor for roots, or AT_FDCWD */
+        int index;              /* Index among the subfolders of parent */
+        int depth;
+        int fd;                 /* Folder descriptor, -1 once closed */
+        int node_fd;            /* Descriptor kept for the node, or -1 */
+        int refs;               /* Subfolders still to be opened from fd, + 1 */
+        int failed;             /* Folder could not be opened */
+        int err;                /* errno if it could not be opened or read */
+        dev_t dev;
+        ino_t ino;
+        long long mtime; /* Before reading it, or -1 (see dir_stamp) */
+
+        int node;               /* Node entries go to, NONE if dropped */
+        int started;            /* First batch was received */
+        int finished;           /* Last batch was received */
+        char *path;             /* Of the folder, for --list */
+        int_da dir_entries;     /* Entries of subfolders, in reading order */
+        sort_key_da keys;       /* Sorted keys of the node children */
+        int keys_valid;
+};
+
+/* Entries read from a folder, posted to the main thread */
+struct batch {
+        struct listing *l;
+        struct sbuf names;
+        raw_entry_da ents;
+        int last;          /* Last batch of the listing */
+        struct load *done; /* If set, this only reports that load is done */
+};
+
+typedef DA(struct batch) batch_da;
+
+struct {
+        pthread_mutex_t lock;
+        batch_da batches;
+        int efd; /* Event fd, written to wake up the main thread */
+} posts = { .lock = PTHREAD_MUTEX_INITIALIZER, .efd = -1 };
+
+void
+post_batch(struct batch *b)
+{
+        int wake;
+
+        pthread_mutex_lock(&posts.lock);
+        wake = posts.batches.size == 0;
+        da_append(&posts.batches, *b);
+        pthread_mutex_unlock(&posts.lock);
+        if (wake && write(posts.efd, &(uint64_t) { 1 }, sizeof(uint64_t)) < 0)
+                error("Can not wake up main thread");
+        *b = (struct batch) { .l = b->l };
+}
+
+int
+is_subfolder(struct raw_entry *raw, const char *name)
+{
+        return raw->type == DT_DIR && strcmp(name, "..");
+}
+
+/* Drop a reference to l. Its descriptor is closed when no subfolder needs
+ * it anymore. */
+void
+listing_release(struct listing *l)
+{
+        if (__atomic_sub_fetch(&l->refs, 1, __ATOMIC_ACQ_REL)) return;
+        close(l->fd);
+        l->fd = -1;
+}
+
+/* Read folder l in batches and queue its subfolders, up to depth levels */
+void
+load_task(void *arg)
+{
+        static __thread char *buf = NULL;
+        struct listing *sub, *l = arg;
+        struct load *load = l->load;
+        struct batch b = { .l = l };
+        struct raw_entry raw;
+        struct dirent64 *entry;
+        struct stat st;
+        struct sbuf subdirs = { 0 };
+        ssize_t nread, off;
+        int limit = BATCH_MIN;
+        int recurse = !load->depth || l->depth < load->depth;
+        int i, nsub = 0;
+        char *name;
+
+        if (!buf) {
+                buf = malloc(GETDENTS_BUF_SIZE);
+                assert(buf);
+        }
+
+        if (l->parent) {
+                l->fd = openat(l->parent->fd, l->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                listing_release(l->parent);
+        } else {
+                l->fd = openat(l->dirfd, l->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                if (l->dirfd >= 0) close(l->dirfd);
+        }
+        if (l->fd < 0) {
+                l->err = errno;
+                error("Can not open dir: %s", l->name);
+                l->failed = 1;
+                b.last = 1;
+                post_batch(&b);
+                goto done;
+        }
+
+        /* The node gets its own descriptor, as l->fd is closed once every
+         * subfolder is open */
+        l->node_fd = NONE;
+        if (__atomic_add_fetch(&open_dirs, 1, __ATOMIC_ACQ_REL) <= max_open_dirs)
+                l->node_fd = dup(l->fd);
+        if (l->node_fd < 0) __atomic_sub_fetch(&open_dirs, 1, __ATOMIC_ACQ_REL);
+
+        perf_add(PERF_READ, syscalls, 3); /* openat, dup and fstat */
+        l->mtime = -1;
+        if (!fstat(l->fd, &st)) {
+                l->dev = st.st_dev;
+                l->ino = st.st_ino;
+                l->mtime = dir_stamp(&st);
+        }
+
+        while (!__atomic_load_n(&load->cancel, __ATOMIC_ACQUIRE) &&
+               (nread = getdents64(l->fd, buf, GETDENTS_BUF_SIZE)) > 0) {
+                perf_add(PERF_READ, syscalls, 1);
+                perf_add(PERF_READ, bytes, nread);
+                for (off = 0; off < nread; off += entry->d_reclen) {
+                        entry = (struct dirent64 *) (buf + off);
+                        if (!strcmp(entry->d_name, ".")) continue; // do not add "^./"
+                        raw.ino = entry->d_ino;
+                        raw.name = b.names.size;
+                        raw.namelen = strlen(entry->d_name);
+                        raw.type = entry->d_type;
+                        /* Some filesystems do not fill d_type */
+                        if (raw.type == DT_UNKNOWN &&
+                            !fstatat(l->fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW))
+                                raw.type = IFTODT(st.st_mode);
+                        sbuf_append(&b.names, entry->d_name, raw.namelen + 1);
+                        da_append(&b.ents, raw);
+                        if (recurse && is_subfolder(&raw, entry->d_name)) {
+                                sbuf_append(&subdirs, entry->d_name, raw.namelen + 1);
+                                ++nsub;
+                        }
+                }
+                if (b.ents.size >= limit) {
+                        post_batch(&b);
+                        if (limit < BATCH_MAX) limit *= 2;
+                }
+        }
+        if (nread < 0) {
+                l->err = errno;
+                error("Can not read dir: %s", l->name);
+        }
+        if (nread < 0 || __atomic_load_n(&load->cancel, __ATOMIC_ACQUIRE)) l->mtime = -1;
+
+        /* Subfolders are queued after the last batch, so the main thread
+         * always gets the folder before its subfolders */
+        b.last = 1;
+        post_batch(&b);
+
+        for (i = 0, name = subdirs.data; i < nsub; i++, name += strlen(name) + 1) {
+                if (__atomic_load_n(&load->cancel, __ATOMIC_ACQUIRE)) break;
+                sub = calloc(1, sizeof *sub);
+                assert(sub);
+                sub->load = load;
+                sub->parent = l;
+                sub->name = strdup(name);
+                sub->dirfd = AT_FDCWD;
+                sub->index = i;
+                sub->depth = l->depth + 1;
+                sub->fd = sub->node_fd = -1;
+                sub->refs = 1;
+                sub->node = NONE;
+                __atomic_add_fetch(&l->refs, 1, __ATOMIC_ACQ_REL);
+                __atomic_add_fetch(&load->active, 1, __ATOMIC_ACQ_REL);
+                pthread_mutex_lock(&load->lock);
+                da_append(&load->listings, sub);
+                pthread_mutex_unlock(&load->lock);
+                pool_submit(&load_group, load_task, sub);
+        }
+        free(subdirs.data);
+        listing_release(l);
+
+done:
+        if (__atomic_sub_fetch(&load->active, 1, __ATOMIC_ACQ_REL)) return;
+        b = (struct batch) { .done = load };
+        post_batch(&b);
+}
+
+int dircache_restore(int n);
+void stub_expand(int n);
+
+/* Read the folder of node n, and its subfolders up to depth levels (0 for
+ * no limit), in background. Entries show up as they are read. A single
+ * level is taken from the listing cache if it is still valid. If the folder
+ * was evicted, the ones that were expanded in it get their stubs back once
+ * it is read (see stub_expand); reading more levels expands them anyway. */
+void
+load_node(int n, int depth)
+{
+        long long start = perf_start();
+        struct load *load;
+        struct listing *l;
+        struct entry *e;
+        int fd;
+
+        if (nodes.data[n].entry != NONE && (e = &entries.data[nodes.data[n].entry])->stub != NONE) {
+                if (depth == 1)
+                        nodes.data[n].stub = e->stub;
+                else
+                        stub_free(e->stub);
+                e->stub = NONE;
+        }
+        if (depth == 1 && dircache_restore(n)) {
+                stub_expand(n);
+                perf_end(PERF_READ, start, nodes.data[n].children.size);
+                return;
+        }
+        load = calloc(1, sizeof *load);
+        l = calloc(1, sizeof *l);
+        assert(load && l);
+        load->start = start;
+        load->depth = depth;
+        load->active = 1;
+        pthread_mutex_init(&load->lock, NULL);
+        da_append(&load->listings, l);
+        da_append(&loads, load);
+
+        l->load = load;
+        l->dirfd = AT_FDCWD;
+        l->depth = 1;
+        l->fd = l->node_fd = -1;
+        l->refs = 1;
+        l->node = n;
+        l->started = 1;
+        nodes.data[n].listing = l;
+
+        /* Open relative to the parent folder, with a copy of its descriptor
+         * as the node could be collapsed while the worker uses it */
+        if (nodes.data[n].entry != NONE) {
+                e = &entries.data[nodes.data[n].entry];
+                fd = nodes.data[e->parent].fd;
+                if (fd >= 0 && (l->dirfd = dup(fd)) >= 0) l->name = strdup(NAME(e));
+        }
+        if (!l->name) {
+                l->dirfd = AT_FDCWD;
+                l->name = strdup(nodes.data[n].path);
+        }
+
+        pool_submit(&load_group, load_task, l);
+}
+
+/* The node of l is freed: drop what is still being read for it. The load is
+ * stopped if it was started for that node. */
+void
+listing_drop(struct listing *l)
+{
+        l->node = NONE;
+        if (!l->parent) __atomic_store_n(&l->load->cancel, 1, __ATOMIC_RELEASE);
+}
+
+/* Cancel every load in progress. Entries already read are kept. */
+void
+load_cancel_all()
+{
+        int i;
+        for (i = 0; i < loads.size; i++)
+                __atomic_store_n(&loads.data[i]->cancel, 1, __ATOMIC_RELEASE);
+}
+
+void
+load_free(struct load *load)
+{
+        struct listing *l;
+        int i;
+
+        for (i = 0; i < load->listings.size; i++) {
+                l = load->listings.data[i];
+                if (l->node != NONE) nodes.data[l->node].listing = NULL;
+                if (l->node_fd >= 0) {
+                        close(l->node_fd);
+                        __atomic_sub_fetch(&open_dirs, 1, __ATOMIC_ACQ_REL);
+                }
+                free(l->name);
+                free(l->path);
+                free(l->dir_entries.data);
+                free(l->keys.data);
+                free(l);
+        }
+        for (i = 0; i < loads.size; i++)
+                if (loads.data[i] == load) da_remove(&loads, i);
+        perf_end(PERF_READ, load->start, 0);
+        free(load->listings.data);
+        pthread_mutex_destroy(&load->lock);
+        free(load);
+}
+
+/* Merge ids, new children of node n being loaded, in its sorted children.
+ * The sorted keys of the children are kept by the listing, so only the new
+ * entries need keys. */
+void
+node_merge(int n, const int *ids, int k)
+{
+        static sort_key_da fresh = { 0 };
+        static sort_key_da merged = { 0 };
+        struct listing *l = nodes.data[n].listing;
+        sort_key_da tmp, *keys = &l->keys;
+        int_da *children = &nodes.data[n].children;
+        int i, j, dirfd = sort_dirfd(n);
+
+        if (!l->keys_valid) {
+                keys->size = 0;
+                for (i = 0; i < children->size; i++) {
+                        da_append(keys, (struct sort_key) { 0 });
+                        sort_key(&keys->data[i], children->data[i], dirfd);
+                }
+                l->keys_valid = 1;
+        } else {
+                /* Names move when the arena grows */
+                for (i = 0; i < keys->size; i++)
+                        keys->data[i].name = NAME(&entries.data[keys->data[i].entry]);
+        }
+
+        fresh.size = 0;
+        for (i = 0; i < k; i++) {
+                da_append(&fresh, (struct sort_key) { 0 });
+                sort_key(&fresh.data[i], ids[i], dirfd);
+        }
+        node_dirfd_done(n, dirfd);
+        sort_keys(fresh.data, fresh.size);
+
+        merged.size = 0;
+        for (i = j = 0; i < keys->size || j < fresh.size;) {
+                if (j == fresh.size ||
+                    (i < keys->size && sort_cmp(&keys->data[i], &fresh.data[j]) <= 0))
+                        da_append(&merged, keys->data[i++]);
+                else
+                        da_append(&merged, fresh.data[j++]);
+        }
+        tmp = *keys;
+        *keys = merged;
+        merged = tmp;
+
+        children->size = 0;
+        for (i = 0; i < keys->size; i++)
+                da_append(children, keys->data[i].entry);
+        node_reindex(n);
+}
+
+/* Children of node n changed outside of a merge */
+void
+node_touch(int n)
+{
+        if (nodes.data[n].listing) nodes.data[n].listing->keys_valid = 0;
+        node_reindex(n);
+}
+
+/* Place the cursor in the middle once the first folder is read, unless the
+ * user moved it already */
+int cursor_pending = 0;
+
+void place_cursor_midwindow();
+
+/* Batch mode (--list): paths are written to stdout instead of shown.
+ * Unordered, batches are written as they come, without building the tree.
+ * Ordered, the tree is built as for the view and written depth first, each
+ * folder once it is read, and freed once written. */
+#define LIST_BUFFER (1 << 20)
+
+struct {
+        int active;
+        int ordered;
+        char sep;     /* Written after every path */
+        int depth;    /* Levels listed, 0 for no limit */
+        struct sbuf out;
+        int status;   /* Exit status: 1 if some folder could not be read */
+        int root;     /* Index in roots of the next one to write */
+        int_da stack; /* Nodes being written, from a root */
+        int_da next;  /* Child of each of them to write next */
+} lister = { .sep = '\n' };
+
+/* Merge a batch posted by a worker in the tree */
+void
+batch_merge(struct batch *b)
+{
+        static int_da ids = { 0 };
+        struct listing *p, *l = b->l;
+        struct raw_entry *raw;
+        struct view_span span;
+        int i, e, n, base;
+        char *path;
+
+        /* Subfolders of a walk get their node with their first batch */
+        if (!l->started) {
+                l->started = 1;
+                p = l->parent;
+                e = (p->node == NONE || l->index >= p->dir_entries.size) ?
+                    NONE :
+                    p->dir_entries.data[l->index];
+                /* Listed folders get a node even if they can not be
+                 * read, to know they are done */
+                if (e != NONE && (!l->failed || lister.active) &&
+                    entries.data[e].parent == p->node &&
+                    entries.data[e].node == NONE &&
+                    !strcmp(NAME(&entries.data[e]), l->name)) {
+                        path = strconcat(nodes.data[p->node].path, "/", l->name);
+                        n = node_new(e, path);
+                        free(path);
+                        node_attach(e, n);
+                        nodes.data[n].listing = l;
+                        l->node = n;
+                }
+        }
+
+        if ((n = l->node) == NONE) goto out;
+
+        if (l->node_fd >= 0 && nodes.data[n].fd < 0) {
+                nodes.data[n].fd = l->node_fd;
+                l->node_fd = NONE;
+        }
+
+        perf_add(PERF_READ, entries, b->ents.size);
+        base = nodes.data[n].names.size;
+        if (b->names.size) node_names_append(&nodes.data[n], b->names.data, b->names.size);
+        ids.size = 0;
+        for (i = 0; i < b->ents.size; i++) {
+                raw = &b->ents.data[i];
+                e = entry_new();
+                entries.data[e] = (struct entry) {
+                        .ino = raw->ino,
+                        .parent = n,
+                        .node = NONE,
+                        .name = base + raw->name,
+                        .namelen = raw->namelen,
+                        .type = raw->type,
+                        .stub = NONE,
+                };
+                da_append(&ids, e);
+                if (is_subfolder(raw, b->names.data + raw->name))
+                        da_append(&l->dir_entries, e);
+        }
+
+        if (ids.size && lister.active) {
+                node_merge(n, ids.data, ids.size);
+        } else if (ids.size) {
+                span = view_span(n);
+                node_merge(n, ids.data, ids.size);
+                view_update_node(n, &span);
+        }
+
+        if (b->last) {
+                l->finished = 1;
+                nodes.data[n].dev = l->dev;
+                nodes.data[n].ino = l->ino;
+                nodes.data[n].mtime = l->failed ? -1 : l->mtime;
+                stub_expand(n);
+        }
+
+        if (b->last && nodes.data[n].entry == NONE && cursor_pending) {
+                place_cursor_midwindow();
+                cursor_pending = 0;
+        }
+
+        /* Folders that could not be read are not left expanded */
+        if (b->last && l->failed && !nodes.data[n].children.size && !lister.active) {
+                for (i = 0; i < roots.size; i++)
+                        if (roots.data[i] == n) da_remove(&roots, i);
+                node_free(n);
+        }
+
+out:
+        free(b->names.data);
+        free(b->ents.data);
+}
+
+void list_batch(struct batch *b);
+void list_error(struct listing *l);
+
+/* Append batch b, of the same folder, to a */
+void
+batch_join(struct batch *a, struct batch *b)
+{
+        int i, base = a->names.size;
+
+        if (b->names.size) sbuf_append(&a->names, b->names.data, b->names.size);
+        for (i = 0; i < b->ents.size; i++) {
+                b->ents.data[i].name += base;
+                da_append(&a->ents, b->ents.data[i]);
+        }
+        a->last = b->last;
+        free(b->names.data);
+        free(b->ents.data);
+}
+
+/* Whether a key is waiting */
+int
+input_pending()
+{
+        struct pollfd p = { .fd = STDIN_FILENO, .events = POLLIN };
+        return poll(&p, 1, 0) > 0;
+}
+
+/* Merge what the workers posted. Batches of a folder posted while the main
+ * thread was busy are merged at once (up to BATCH_MAX entries), as every
+ * merge takes time for the entries already there too. Merging stops when
+ * a key comes, so keys wait for one merge at most: the rest is merged in
+ * the next iterations. */
+void
+load_process()
+{
+        static batch_da batches = { 0 };
+        struct batch *b;
+        uint64_t count;
+        int i, k;
+
+        if (read(posts.efd, &count, sizeof count) < 0 && errno != EAGAIN)
+                error("Can not read event fd");
+        pthread_mutex_lock(&posts.lock);
+        for (i = 0; i < posts.batches.size; i++)
+                da_append(&batches, posts.batches.data[i]);
+        posts.batches.size = 0;
+        pthread_mutex_unlock(&posts.lock);
+
+        for (i = k = 0; i < batches.size; i++) {
+                b = k ? &batches.data[k - 1] : NULL;
+                if (b && !b->done && !batches.data[i].done && b->l == batches.data[i].l &&
+                    b->ents.size + batches.data[i].ents.size <= BATCH_MAX)
+                        batch_join(b, &batches.data[i]);
+                else
+                        batches.data[k++] = batches.data[i];
+        }
+        batches.size = k;
+
+        for (i = 0; i < batches.size;) {
+                b = &batches.data[i++];
+                if (b->done) {
+                        load_free(b->done);
+                } else if (lister.active && !lister.ordered) {
+                        if (b->last && b->l->err) list_error(b->l);
+                        list_batch(b);
+                } else {
+                        if (lister.active && b->last && b->l->err) list_error(b->l);
+                        batch_merge(b);
+                        if (!lister.active && input_pending()) break;
+                }
+        }
+        memmove(batches.data, batches.data + i, (batches.size - i) * sizeof *batches.data);
+        batches.size -= i;
+        /* Come back for the rest */
+        if (batches.size && write(posts.efd, &(uint64_t) { 1 }, sizeof(uint64_t)) < 0)
+                error("Can not wake up main thread");
+}
+
+/* Listings of folders collapsed or left, to show them again without reading
+ * them. A listing is moved out of the cache while a node shows it, and back
+ * when the node is freed. The least recently used are dropped first. */
+#define DIRCACHE_LISTINGS 64
+#define DIRCACHE_ENTRIES (1 << 20) /* In all the listings */
+
+struct cached_listing {
+        dev_t dev;
+        ino_t ino;
+        long long mtime; /* Of the folder the children are valid for, ns */
+        int order;       /* sort_order of the children */
+        struct sbuf names;
+        raw_entry_da children;
+};
+
+typedef DA(struct cached_listing) cached_listing_da;
+
+struct {
+        cached_listing_da listings; /* Least recently used first */
+        int entries;
+        long long bytes;
+} dircache = { 0 };
+
+/* Bytes taken by listing c */
+long long
+cached_listing_bytes(struct cached_listing *c)
+{
+        return c->names.capacity + (long long) c->children.capacity * sizeof *c->children.data;
+}
+
+void
+dircache_forget(int i)
+{
+        struct cached_listing *c = &dircache.listings.data[i];
+
+        dircache.entries -= c->children.size;
+        dircache.bytes -= cached_listing_bytes(c);
+        free(c->names.data);
+        free(c->children.data);
+        da_remove(&dircache.listings, i);
+}
+
+/* Keep the children of node n in the cache, if it can tell later whether
+ * they are still valid */
+void
+dircache_save(int n)
+{
+        struct node *node = &nodes.data[n];
+        struct cached_listing c = { 0 };
+        struct entry *entry;
+        struct stat st;
+        long long mtime = node->mtime;
+        int i, fd, unread = 0;
+
+        if (node->listing) return; /* Not read yet */
+        if (lister.active) return;  /* Never shown again */
+        if (memory.evicting) return;
+
+        /* Watched since it was read, its children followed every change, so
+         * they are valid for its mtime now unless some change was not
+         * applied yet */
+        if (node->wd != NONE && !watch.overflow &&
+            !ioctl(watch.fd, FIONREAD, &unread) && !unread) {
+                for (i = 0; i < watch.changes.size; i++)
+                        if (watch.changes.data[i].wd == node->wd && !watch.changes.data[i].attr) break;
+                if (i == watch.changes.size && (fd = node_dirfd(n)) >= 0) {
+                        if (!fstat(fd, &st) && st.st_nlink && st.st_dev == node->dev && st.st_ino == node->ino)
+                                mtime = dir_stamp(&st);
+                        node_dirfd_done(n, fd);
+                }
+        }
+        if (mtime < 0) return;
+
+        c.dev = node->dev;
+        c.ino = node->ino;
+        c.mtime = mtime;
+        c.order = sort_order;
+        for (i = 0; i < node->children.size; i++) {
+                entry = &entries.data[node->children.data[i]];
+                da_append(&c.children, ((struct raw_entry) {
+                                               .ino = entry->ino,
+                                               .name = entry->name,
+                                               .namelen = entry->namelen,
+                                               .type = entry->type,
+                                       }));
+        }
+        c.names = node->names;
+        memory.names -= node->names.capacity;
+        node->names = (struct sbuf) { 0 };
+
+        for (i = 0; i < dircache.listings.size; i++)
+                if (dircache.listings.data[i].dev == c.dev && dircache.listings.data[i].ino == c.ino) {
+                        dircache_forget(i);
+                        break;
+                }
+        da_append(&dircache.listings, c);
+        dircache.entries += c.children.size;
+        dircache.bytes += cached_listing_bytes(&c);
+        while (dircache.listings.size > DIRCACHE_LISTINGS || dircache.entries > DIRCACHE_ENTRIES)
+                dircache_forget(0);
+}
+
+/* Show the cached children of node n if its folder did not change since.
+ * Return if they were */
+int
+dircache_restore(int n)
+{
+        struct node *node = &nodes.data[n];
+        struct cached_listing *c;
+        struct raw_entry *raw;
+        struct entry *entry;
+        struct view_span span;
+        struct stat st;
+        int i, k, e, fd = -1;
+
+        if (!dircache.listings.size) return 0;
+        if (node->entry != NONE) {
+                entry = &entries.data[node->entry];
+                if (nodes.data[entry->parent].fd >= 0)
+                        fd = openat(nodes.data[entry->parent].fd, NAME(entry), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        }
+        if (fd < 0) fd = open(node->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) return 0;
+        perf_add(PERF_READ, syscalls, 2);
+        if (fstat(fd, &st)) goto miss;
+
+        for (i = dircache.listings.size - 1; i >= 0; i--)
+                if (dircache.listings.data[i].dev == st.st_dev && dircache.listings.data[i].ino == st.st_ino) break;
+        if (i < 0) goto miss;
+        c = &dircache.listings.data[i];
+        if (c->mtime != st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec) {
+                dircache_forget(i);
+                goto miss;
+        }
+        if (c->order != sort_order) goto miss;
+
+        span = view_span(n);
+        node->names = c->names;
+        memory.names += node->names.capacity;
+        for (k = 0; k < c->children.size; k++) {
+                raw = &c->children.data[k];
+                e = entry_new();
+                entries.data[e] = (struct entry) {
+                        .ino = raw->ino,
+                        .parent = n,
+                        .node = NONE,
+                        .name = raw->name,
+                        .namelen = raw->namelen,
+                        .type = raw->type,
+                        .stub = NONE,
+                };
+                da_append(&node->children, e);
+        }
+        node->dev = c->dev;
+        node->ino = c->ino;
+        node->mtime = c->mtime;
+        dircache.entries -= c->children.size;
+        dircache.bytes -= cached_listing_bytes(c);
+        free(c->children.data);
+        da_remove(&dircache.listings, i);
+
+        if (__atomic_add_fetch(&open_dirs, 1, __ATOMIC_ACQ_REL) <= max_open_dirs) {
+                node->fd = fd;
+        } else {
+                __atomic_sub_fetch(&open_dirs, 1, __ATOMIC_ACQ_REL);
+                close(fd);
+        }
+        debug("Listing of %s taken from the cache", node->path);
+        node_reindex(n);
+        view_update_node(n, &span);
+        if (node->entry == NONE && cursor_pending) {
+                place_cursor_midwindow();
+                cursor_pending = 0;
+        }
+        return 1;
+
+miss:
+        close(fd);
+        return 0;
+}
+
+/* Add path as a root. Its entries are listed at top level, after the roots
+ * that sort before it. Folders are read up to depth levels. */
+void
+add_root(const char *path, int depth)
+{
+        int i, n;
+
+        n = node_new(NONE, path);
+        for (i = 0; i < roots.size; i++)
+                if (strcmp(nodes.data[roots.data[i]].path, path) > 0) break;
+        da_insert(&roots, n, i);
+        load_node(n, depth);
+}
+
+/* Expand folder at row, up to depth levels (0 for no limit). Its entries
+ * are inserted after it as they are read. */
+void
+add_subfolder(int row, int depth)
+{
+        int n, e = view_at(row);
+        char *p = strconcat(PATH(&entries.data[e]), "/", NAME(&entries.data[e]));
+
+        n = node_new(e, p);
+        free(p);
+        node_attach(e, n);
+        load_node(n, depth);
+}
+
+/* Collapse folder at row */
+void
+remove_subfolder(int row)
+{
+        node_free(ROW(row).node);
+}
+
+int
+is_folder_open(int row)
+{
+        return ROW(row).node != NONE;
+}
+
+/* Remove entry at row (and everything loaded under it) from the tree */
+void
+drop_row(int row)
+{
+        int e = view_at(row);
+        int n = entries.data[e].parent;
+
+        if (entries.data[e].node != NONE) remove_subfolder(row);
+        da_remove(&nodes.data[n].children, entries.data[e].pos);
+        node_touch(n);
+        entry_free(e);
+}
+
+/* Insert ids, new children of node n, at their sorted positions. Only the
+ * new entries and the children they are compared with get sort keys. */
+void
+node_insert(int n, const int *ids, int k)
+{
+        static sort_key_da fresh = { 0 };
+        static int_da merged = { 0 };
+        int_da tmp, *children = &nodes.data[n].children;
+        struct sort_key key;
+        int i, lo, hi, mid, prev = 0, dirfd = sort_dirfd(n);
+
+        fresh.size = 0;
+        for (i = 0; i < k; i++) {
+                da_append(&fresh, (struct sort_key) { 0 });
+                sort_key(&fresh.data[i], ids[i], dirfd);
+        }
+        sort_keys(fresh.data, fresh.size);
+
+        merged.size = 0;
+        for (i = 0; i < k; i++) {
+                lo = prev;
+                hi = children->size;
+                while (lo < hi) {
+                        mid = (lo + hi) / 2;
+                        sort_key(&key, children->data[mid], dirfd);
+                        if (sort_cmp(&key, &fresh.data[i]) < 0)
+                                lo = mid + 1;
+                        else
+                                hi = mid;
+                }
+                for (; prev < lo; prev++)
+                        da_append(&merged, children->data[prev]);
+                da_append(&merged, fresh.data[i].entry);
+        }
+        for (; prev < children->size; prev++)
+                da_append(&merged, children->data[prev]);
+        node_dirfd_done(n, dirfd);
+
+        tmp = *children;
+        *children = merged;
+        merged = tmp;
+        node_touch(n);
+}
+
+char *journal_relative(const char *folder);
+
+/* Node of folder, from /, if it is loaded, or NONE */
+int
+folder_node(const char *folder)
+{
+        char *path = journal_relative(folder);
+        int n;
+
+        for (n = 0; n < nodes.size; n++)
+                if (nodes.data[n].path && !strcmp(nodes.data[n].path, path)) break;
+        free(path);
+        return n < nodes.size ? n : NONE;
+}
+
+/* Insert deleted entry back in its folder, if the folder is loaded */
+void
+restore_entry(struct deleted_entry *d)
+{
+        struct view_span span;
+        int n, e;
+
+        if ((n = folder_node(d->path)) == NONE) return;
+
+        /* It could be back already, read from the folder events */
+        for (e = 0; e < nodes.data[n].children.size; e++)
+                if (!strcmp(NAME(&entries.data[nodes.data[n].children.data[e]]), d->name))
+                        return;
+
+        span = view_span(n);
+        e = entry_add(n, d->name, strlen(d->name), d->type, d->ino);
+        node_insert(n, &e, 1);
+        view_update_node(n, &span);
+}
+
+/* Read the pending folder events */
+void
+watch_read()
+{
+        char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        const struct inotify_event *ev;
+        ssize_t len;
+        char *p;
+
+        while ((len = read(watch.fd, buf, sizeof buf)) > 0) {
+                for (p = buf; p < buf + len; p += sizeof *ev + ev->len) {
+                        ev = (const struct inotify_event *) p;
+                        if (ev->mask & IN_Q_OVERFLOW) {
+                                warn("Folder events overflow: some changes are not shown");
+                                watch.overflow = 1;
+                        }
+                        if (!ev->len || ev->wd >= watch.nodes.size ||
+                            watch.nodes.data[ev->wd] == NONE)
+                                continue;
+                        da_append(&watch.changes, ((struct change) {
+                                                          .wd = ev->wd,
+                                                          .name = watch.names.size,
+                                                          .add = !!(ev->mask & (IN_CREATE | IN_MOVED_TO)),
+                                                          .attr = !!(ev->mask & (IN_ATTRIB | IN_CLOSE_WRITE)),
+                                                          .seq = watch.changes.size,
+                                                  }));
+                        sbuf_append(&watch.names, ev->name, strlen(ev->name) + 1);
+                }
+        }
+        if (len < 0 && errno != EAGAIN) error("Can not read folder events");
+        if (watch.changes.size && !watch.deadline)
+                watch.deadline = now_ms() + WATCH_DELAY_MS;
+}
+
+#define CHANGE_NAME(c) (watch.names.data + (c)->name)
+
+/* Order changes by watch, then by name, then as they were read */
+int
+change_cmp(const void *_a, const void *_b)
+{
+        const struct change *a = _a;
+        const struct change *b = _b;
+        int cmp;
+
+        if (a->wd != b->wd) return a->wd < b->wd ? -1 : 1;
+        if ((cmp = strcmp(CHANGE_NAME(a), CHANGE_NAME(b)))) return cmp;
+        return a->seq - b->seq;
+}
+
+int
+change_name_cmp(const void *name, const void *c)
+{
+        return strcmp(name, CHANGE_NAME((const struct change *) c));
+}
+
+void tree_changed(int n, int dirfd, int written);
+
+/* Apply changes c, of a single folder and sorted by name, to node n. Only
+ * the last creation or removal of each name counts. Entries whose metadata
+ * changed are marked to read it again. */
+void
+node_apply(int n, struct change *c, int k)
+{
+        static int_da fresh = { 0 };
+        int_da *children = &nodes.data[n].children;
+        struct change *f;
+        struct view_span span;
+        struct stat st;
+        const char *name;
+        int i, j, l, e, dirfd, removed = 0, changed = 0, written = 0;
+
+        for (i = 0; i < k; i++)
+                c[i].entry = NONE;
+        for (i = 0; i < children->size; i++) {
+                e = children->data[i];
+                name = NAME(&entries.data[e]);
+                if (!(f = bsearch(name, c, k, sizeof *c, change_name_cmp))) continue;
+                while (f > c && !strcmp(CHANGE_NAME(f - 1), name))
+                        f--;
+                for (; f < c + k && !strcmp(CHANGE_NAME(f), name); f++)
+                        f->entry = e;
+        }
+
+        span = view_span(n);
+        dirfd = node_dirfd(n);
+        fresh.size = 0;
+        for (i = 0; i < k; i++) {
+                e = c[i].entry;
+                if (c[i].attr) {
+                        if (e != NONE) metas.data[e].state = META_STALE;
+                        written = 1;
+                        continue;
+                }
+                /* The last creation or removal of a name is the one that counts */
+                for (l = i + 1; l < k && !strcmp(CHANGE_NAME(&c[l]), CHANGE_NAME(&c[i])) && c[l].attr; l++)
+                        ;
+                if (l < k && !strcmp(CHANGE_NAME(&c[l]), CHANGE_NAME(&c[i]))) continue;
+                if (!c[i].add) {
+                        if (e == NONE) continue;
+                        if (entries.data[e].node != NONE) node_free(entries.data[e].node);
+                        entries.data[e].parent = NONE;
+                        removed++;
+                } else if (fstatat(dirfd, CHANGE_NAME(&c[i]), &st, AT_SYMLINK_NOFOLLOW)) {
+                        continue; /* Already gone */
+                } else if (e == NONE) {
+                        da_append(&fresh, entry_add(n, CHANGE_NAME(&c[i]), strlen(CHANGE_NAME(&c[i])),
+                                                    IFTODT(st.st_mode), st.st_ino));
+                } else if (entries.data[e].node == NONE) {
+                        /* Replaced */
+                        entries.data[e].ino = st.st_ino;
+                        entries.data[e].type = IFTODT(st.st_mode);
+                        metas.data[e].state = META_STALE;
+                        changed = 1;
+                }
+        }
+        if (removed || fresh.size || changed || written) tree_changed(n, dirfd, written);
+        node_dirfd_done(n, dirfd);
+
+        if (removed) {
+                for (i = j = 0; i < children->size; i++) {
+                        e = children->data[i];
+                        if (entries.data[e].parent == NONE)
+                                entry_free(e);
+                        else
+                                children->data[j++] = e;
+                }
+                children->size = j;
+                node_touch(n);
+        }
+        if (fresh.size) node_insert(n, fresh.data, fresh.size);
+        if (removed || fresh.size) view_update_node(n, &span);
+}
+
+/* Apply the changes read so far. Folders being read keep theirs until they
+ * are done, as they could list them too. */
+void
+watch_apply()
+{
+        static change_da keep = { 0 };
+        static struct sbuf keep_names = { 0 };
+        struct change *c;
+        change_da tmp;
+        struct sbuf stmp;
+        int i, j, n, next, loading;
+
+        c = watch.changes.data;
+        qsort(c, watch.changes.size, sizeof *c, change_cmp);
+        keep.size = 0;
+        keep_names.size = 0;
+
+        for (i = 0; i < watch.changes.size; i = j) {
+                for (j = i; j < watch.changes.size && c[j].wd == c[i].wd; j++)
+                        ;
+                loading = 0;
+                for (n = watch.nodes.data[c[i].wd]; n != NONE; n = nodes.data[n].wnext)
+                        if (nodes.data[n].listing) loading = 1;
+                if (loading) {
+                        for (; i < j; i++) {
+                                da_append(&keep, c[i]);
+                                keep.data[keep.size - 1].name = keep_names.size;
+                                keep.data[keep.size - 1].seq = keep.size - 1;
+                                sbuf_append(&keep_names, CHANGE_NAME(&c[i]),
+                                            strlen(CHANGE_NAME(&c[i])) + 1);
+                        }
+                        continue;
+                }
+                for (n = watch.nodes.data[c[i].wd]; n != NONE; n = next) {
+                        next = nodes.data[n].wnext;
+                        node_apply(n, c + i, j - i);
+                }
+        }
+
+        tmp = watch.changes;
+        watch.changes = keep;
+        keep = tmp;
+        stmp = watch.names;
+        watch.names = keep_names;
+        keep_names = stmp;
+        watch.deadline = watch.changes.size ? now_ms() + WATCH_DELAY_MS : 0;
+}
+
+/* Swap entry at row with its previous (dir < 0) or next (dir > 0) sibling.
+ * Return the new row of the entry. */
+int
+move_row(int row, int dir)
+{
+        int e = view_at(row), k = entries.data[e].pos;
+        int n = entries.data[e].parent;
+        int_da *children = &nodes.data[n].children;
+
+        if (k + dir < 0 || k + dir >= children->size) return row;
+        children->data[k] = children->data[k + dir];
+        children->data[k + dir] = e;
+        node_touch(n);
+        return entry_row(e);
+}
+
+void
+print_file(struct sbuf *sb, struct entry *entry)
+{
+        char *path = PATH(entry);
+        if (!memcmp(path, "./", 2)) path += 2; // remove the ugly ./ prefix
+        if (strcmp(path, ".")) {
+                sbuf_puts(sb, path);
+                sbuf_append(sb, "/", 1);
+        }
+        sbuf_puts(sb, COLORS[entry->type]);
+        sbuf_append(sb, NAME(entry), entry->namelen);
+        sbuf_append(sb, "\e[0m", 4);
+}
+
+/* Rows drawn lately, as print_file formats them, by entry id. Moving the
+ * window only formats the rows coming into it. */
+#define ROW_CACHE 4096
+
+struct row_format {
+        int entry;
+        unsigned gen; /* Of the entry, as ids are reused */
+        unsigned char type;
+        struct sbuf text;
+};
+
+struct row_format row_cache[ROW_CACHE];
+
+/* Append entry e to sb as print_file does */
+void
+print_row(struct sbuf *sb, int e)
+{
+        struct row_format *f = &row_cache[e % ROW_CACHE];
+
+        if (f->entry != e || f->gen != metas.data[e].gen || f->type != entries.data[e].type) {
+                f->entry = e;
+                f->gen = metas.data[e].gen;
+                f->type = entries.data[e].type;
+                f->text.size = 0;
+                print_file(&f->text, &entries.data[e]);
+        }
+        sbuf_append(sb, f->text.data, f->text.size);
+}
+
+/* Cut row to cols columns. Escape sequences take none, and every char
+ * takes one, whatever its width */
+void
+row_fit(struct sbuf *row, int cols)
+{
+        unsigned char *s = (unsigned char *) row->data;
+        int i, n = 0;
+
+        for (i = 0; i < row->size; i++) {
+                if (s[i] == '\e' && i + 1 < row->size && s[i + 1] == '[') {
+                        for (i += 2; i < row->size && (s[i] < 0x40 || s[i] > 0x7e); i++)
+                                ;
+                        continue;
+                }
+                if ((s[i] & 0xc0) == 0x80) continue; /* Rest of an UTF-8 char */
+                if (n++ == cols) {
+                        row->size = i;
+                        sbuf_append(row, "\e[0m", 4);
+                        return;
+                }
+        }
+}
+
+void
+calc_wsize(int _)
+{
+        /* To be called on SIGWINCH */
+        ioctl(0, TIOCGWINSZ, &wsize);
+}
+
+/* Line being edited in the status line. Keys go to it while active. */
+struct {
+        int active;
+        const char *label;
+        char text[1024];
+        int len;
+        void (*done)(const char *text);    /* Called with the accepted text, if set */
+        void (*changed)(const char *text); /* Called after every edit, if set */
+        void (*cancel)();                  /* Called if canceled, if set */
+} prompt = { 0 };
+
+/* Search. The pattern is compiled once, and the rows matching it are kept
+ * until the view changes, so moving between matches does not search again.
+ * Rows are matched by their path. Only the paths containing a literal that
+ * every match needs are built and matched against the regex. */
+struct {
+        char pattern[1024];
+        regex_t regex;
+        int compiled;
+        char lit[1024]; /* Literal every match contains, lowercase */
+        int litlen;
+        int plain;        /* The pattern is the literal alone */
+        int_da rows;      /* Matching rows, ascending */
+        unsigned version; /* view_version the rows were found for */
+        int valid;
+        int current; /* Index in rows of the last match selected */
+        int global;  /* Search the index instead of the view */
+        u32_da hits;    /* Matching index entries */
+        int hits_valid; /* hits are for the pattern and the index mapped */
+        int hit;        /* Index in hits of the last match selected */
+} finder = { 0 };
+
+/* Longest literal every match of extended regex p contains, lowercase, to
+ * lit. Return its length, 0 if there is none. plain is set if p is only
+ * that literal. */
+int
+search_literal(const char *p, char *lit, int *plain)
+{
+        char run[1024];
+        char close;
+        int len = 0, best = 0, depth = 0;
+
+        *plain = 1;
+#define END_RUN()                               \
+        do {                                    \
+                if (len > best) {               \
+                        memcpy(lit, run, len);  \
+                        best = len;             \
+                }                               \
+                len = 0;                        \
+        } while (0)
+
+        for (; *p; p++) {
+                switch (*p) {
+                case '|':
+                        /* Alternatives: nothing is required */
+                        *plain = 0;
+                        return 0;
+                case '(':
+                        ++depth;
+                        *plain = 0;
+                        END_RUN();
+                        break;
+                case ')':
+                        --depth;
+                        END_RUN();
+                        break;
+                case '[':
+                        *plain = 0;
+                        END_RUN();
+                        if (*++p == '^') ++p;
+                        if (*p == ']') ++p;
+                        while (*p && *p != ']') {
+                                /* Classes like [:alpha:] end in :] */
+                                if (p[0] == '[' && p[1] && strchr(":=.", p[1])) {
+                                        close = p[1];
+                                        for (p += 2; *p && !(p[0] == close && p[1] == ']'); p++)
+                                                ;
+                                        if (*p) ++p;
+                                }
+                                if (*p) ++p;
+                        }
+                        if (!*p) return 0;
+                        break;
+                case '*':
+                case '?':
+                case '{':
+                        /* The previous char is optional */
+                        *plain = 0;
+                        if (len) --len;
+                        END_RUN();
+                        if (*p == '{')
+                                while (p[1] && *p != '}')
+                                        ++p;
+                        break;
+                case '+':
+                case '.':
+                case '^':
+                case '$':
+                        *plain = 0;
+                        END_RUN();
+                        break;
+                case '\\':
+                        if (p[1] && !isalnum((unsigned char) p[1])) {
+                                ++p;
+                                goto literal;
+                        }
+                        *plain = 0;
+                        END_RUN();
+                        if (p[1]) ++p;
+                        break;
+                default:
+                literal:
+                        if (depth)
+                                *plain = 0;
+                        else if (len < (int) sizeof run)
+                                run[len++] = tolower((unsigned char) *p);
+                        break;
+                }
+        }
+        END_RUN();
+#undef END_RUN
+        return best;
+}
+
+/* Whether s, of n bytes, contains lit (lowercase), ignoring case. The
+ * first char is looked for with memchr, in both cases. */
+int
+search_find(const char *s, int n, const char *lit, int litlen)
+{
+        const char *a, *b;
+        int c = lit[0], C = toupper(c);
+
+        while (n >= litlen) {
+                a = memchr(s, c, n - litlen + 1);
+                if (c != C && (b = memchr(s, C, a ? a - s : n - litlen + 1))) a = b;
+                if (!a) return 0;
+                if (!strncasecmp(a, lit, litlen)) return 1;
+                n -= a - s + 1;
+                s = a + 1;
+        }
+        return 0;
+}
+
+/* Compile pattern. An empty pattern clears the search */
+void
+search_set(const char *pattern)
+{
+        char buf[1024];
+        int errcode, size;
+
+        if (finder.compiled) regfree(&finder.regex);
+        finder.compiled = 0;
+        finder.valid = 0;
+        finder.current = 0;
+        finder.global = 0;
+        finder.hits_valid = 0;
+        snprintf(finder.pattern, sizeof finder.pattern, "%s", pattern);
+        if (!pattern[0]) return;
+
+        if ((errcode = regcomp(&finder.regex, pattern, REG_EXTENDED | REG_ICASE | REG_NEWLINE))) {
+                size = regerror(errcode, &finder.regex, buf, sizeof buf);
+                report("regcomp error: %*s", size, buf);
+                return;
+        }
+        finder.compiled = 1;
+        finder.litlen = search_literal(pattern, finder.lit, &finder.plain);
+}
+
+/* Find the rows matching the pattern */
+void
+search_run()
+{
+        static struct sbuf path = { 0 };
+        static int_da node_hit = { 0 }; /* Whether a folder path has the literal */
+        long long start = perf_start();
+        struct entry *e;
+        const char *lit = finder.lit;
+        const int *rows = view_rows();
+        int i, hit, litlen = finder.litlen;
+        int slash = litlen && memchr(lit, '/', litlen);
+
+        node_hit.size = 0;
+        for (i = 0; i < nodes.size; i++)
+                da_append(&node_hit, NONE);
+
+        finder.rows.size = 0;
+        for (i = 0; i < view.size; i++) {
+                e = &entries.data[rows[i]];
+                if (litlen) {
+                        if (node_hit.data[e->parent] == NONE)
+                                node_hit.data[e->parent] = search_find(PATH(e), strlen(PATH(e)), lit, litlen);
+                        hit = node_hit.data[e->parent] || search_find(NAME(e), e->namelen, lit, litlen);
+                        /* The literal could span the path and the name */
+                        if (!hit && slash) {
+                                entry_path(&path, e);
+                                hit = search_find(path.data, path.size, lit, litlen);
+                        }
+                        if (!hit) continue;
+                        if (finder.plain) {
+                                da_append(&finder.rows, i);
+                                continue;
+                        }
+                }
+                entry_path(&path, e);
+                if (!regexec(&finder.regex, path.data, 0, NULL, 0))
+                        da_append(&finder.rows, i);
+        }
+        finder.version = view_version;
+        finder.valid = 1;
+        finder.current = 0;
+        perf_end(PERF_SEARCH, start, view.size);
+}
+
+/* First match at or after row */
+int
+search_lower_bound(int row)
+{
+        int lo = 0, hi = finder.rows.size, mid;
+        while (lo < hi) {
+                mid = (lo + hi) / 2;
+                if (finder.rows.data[mid] < row)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        return lo;
+}
+
+void search_index(int dir);
+
+/* Select the next (dir > 0) or previous (dir < 0) match, wrapping around */
+void
+search_next(int dir)
+{
+        int c, size;
+
+        if (!finder.compiled) return;
+        if (finder.global) {
+                search_index(dir);
+                return;
+        }
+        if (!finder.valid || finder.version != view_version) search_run();
+        /* Nothing in view: look in the index */
+        if (!(size = finder.rows.size)) {
+                search_index(dir);
+                return;
+        }
+
+        c = finder.current;
+        if (c < size && finder.rows.data[c] == selected_row)
+                c += dir;
+        else {
+                c = search_lower_bound(selected_row);
+                if (dir < 0)
+                        --c;
+                else if (c < size && finder.rows.data[c] == selected_row)
+                        ++c;
+        }
+        c = (c + size) % size;
+        finder.current = c;
+        selected_row = finder.rows.data[c];
+}
+
+/* Append the match counter to sb, if the matches are up to date */
+void
+search_count(struct sbuf *sb)
+{
+        int c;
+
+        if (finder.global) {
+                if (finder.hits_valid)
+                        sbuf_printf(sb, " [%d/%d]", finder.hits.size ? finder.hit + 1 : 0, finder.hits.size);
+                return;
+        }
+        if (!finder.valid || finder.version != view_version) return;
+        c = finder.current;
+        if (c >= finder.rows.size || finder.rows.data[c] != selected_row)
+                c = search_lower_bound(selected_row);
+        if (c < finder.rows.size && finder.rows.data[c] == selected_row)
+                sbuf_printf(sb, " [%d/%d]", c + 1, finder.rows.size);
+        else
+                sbuf_printf(sb, " [-/%d]", finder.rows.size);
+}
+
+/* Filename index. The tree under the working directory is crawled in
+ * background and written to a file under ~/.cache/fl, which is mapped to
+ * search the folders that are not expanded. Folders whose mtime did not
+ * change since the last crawl are not read again. Names are interned, and
+ * every trigram of them has the list of names containing it. */
+#define INDEX_DIR ".cache/fl" /* Start at HOME */
+#define INDEX_MAGIC "flindex1"
+#define INDEX_NONE UINT32_MAX
+#define INDEX_TRIS (1 << 24)
+
+struct index_header {
+        char magic[8];
+        uint32_t nfolders;
+        uint32_t nentries;
+        uint32_t nnames;
+        uint32_t ntris;
+        uint64_t npostings;
+        /* Offsets of the sections */
+        uint64_t folders;
+        uint64_t entries;
+        uint64_t names;
+        uint64_t byname;
+        uint64_t tris;
+        uint64_t postings;
+        uint64_t strings;
+        uint64_t strings_size;
+};
+
+/* Folders are in depth first order, the working directory first. The
+ * entries of a folder are contiguous and sorted by name, and the entries
+ * of its subtree are all the entries up to the ones of folder last. */
+struct index_folder {
+        int64_t mtime;
+        uint32_t entry; /* Entry of the folder in its parent, or INDEX_NONE */
+        uint32_t first;
+        uint32_t count;
+        uint32_t last; /* First folder after its subtree */
+};
+
+struct index_entry {
+        uint32_t folder; /* Folder it is listed in */
+        uint32_t name;
+        uint32_t child; /* Folder of the entry if it was crawled, or INDEX_NONE */
+        uint32_t type;
+};
+
+/* Interned name. byname[first, first + count) are the entries with it */
+struct index_name {
+        uint32_t string; /* Offset in strings */
+        uint32_t first;
+        uint32_t count;
+};
+
+/* postings[start, start + count) are the names containing tri, ascending */
+struct index_tri {
+        uint32_t tri;
+        uint32_t start;
+        uint32_t count;
+};
+
+typedef DA(struct index_folder) index_folder_da;
+typedef DA(struct index_entry) index_entry_da;
+typedef DA(struct index_name) index_name_da;
+
+struct index_map {
+        void *data;
+        size_t size;
+        const struct index_header *h;
+        const struct index_folder *folders;
+        const struct index_entry *entries;
+        const struct index_name *names;
+        const uint32_t *byname;
+        const struct index_tri *tris;
+        const uint32_t *postings;
+        const char *strings;
+};
+
+#define INDEX_NAME(m, i) ((m)->strings + (m)->names[i].string)
+
+struct {
+        int enabled;
+        char *path; /* Index file of the working directory */
+        struct index_map map;
+        int generation; /* Changes with the working directory */
+        int ready;      /* Set by the crawler once the index file is written */
+} file_index = { 0 };
+
+void
+index_unmap(struct index_map *m)
+{
+        if (m->data) munmap(m->data, m->size);
+        *m = (struct index_map) { 0 };
+}
+
+/* Whether n items of size bytes at offset off fit in the map, aligned */
+int
+index_section(const struct index_map *m, uint64_t off, uint64_t n, size_t size)
+{
+        return !(off & 7) && off <= m->size && n <= (m->size - off) / size;
+}
+
+/* Whether the ids the sections of m hold are in their bounds, so a broken
+ * file can not make lookups read out of the map */
+int
+index_valid(const struct index_map *m)
+{
+        const struct index_header *h = m->h;
+        const struct index_folder *f;
+        const struct index_entry *e;
+        const struct index_name *n;
+        uint64_t i;
+
+        if (!h->strings_size || m->strings[h->strings_size - 1]) return 0;
+        for (i = 0; i < h->nfolders; i++) {
+                f = &m->folders[i];
+                /* Folders are listed in their parent, which comes first */
+                if ((i ? f->entry >= h->nentries || m->entries[f->entry].folder >= i : f->entry != INDEX_NONE) ||
+                    f->first > h->nentries || f->count > h->nentries - f->first ||
+                    f->last <= i || f->last > h->nfolders)
+                        return 0;
+        }
+        for (i = 0; i < h->nentries; i++) {
+                e = &m->entries[i];
+                if (e->folder >= h->nfolders || e->name >= h->nnames ||
+                    (e->child != INDEX_NONE && e->child >= h->nfolders) || m->byname[i] >= h->nentries)
+                        return 0;
+        }
+        for (i = 0; i < h->nnames; i++) {
+                n = &m->names[i];
+                if (n->string >= h->strings_size || n->first > h->nentries || n->count > h->nentries - n->first)
+                        return 0;
+        }
+        for (i = 0; i < h->ntris; i++)
+                if (m->tris[i].start > h->npostings || m->tris[i].count > h->npostings - m->tris[i].start)
+                        return 0;
+        for (i = 0; i < h->npostings; i++)
+                if (m->postings[i] >= h->nnames) return 0;
+        return 1;
+}
+
+/* Map index file path. Return 0 on success */
+int
+index_map(const char *path, struct index_map *m)
+{
+        const struct index_header *h;
+        struct stat st;
+        int fd;
+
+        *m = (struct index_map) { 0 };
+        if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) return -1;
+        if (fstat(fd, &st) || st.st_size < (off_t) sizeof *h) {
+                close(fd);
+                return -1;
+        }
+        m->size = st.st_size;
+        m->data = mmap(NULL, m->size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (m->data == MAP_FAILED) {
+                m->data = NULL;
+                return -1;
+        }
+
+        h = m->h = m->data;
+        if (memcmp(h->magic, INDEX_MAGIC, 8) ||
+            !index_section(m, h->folders, h->nfolders, sizeof *m->folders) ||
+            !index_section(m, h->entries, h->nentries, sizeof *m->entries) ||
+            !index_section(m, h->names, h->nnames, sizeof *m->names) ||
+            !index_section(m, h->byname, h->nentries, sizeof *m->byname) ||
+            !index_section(m, h->tris, h->ntris, sizeof *m->tris) ||
+            !index_section(m, h->postings, h->npostings, sizeof *m->postings) ||
+            !index_section(m, h->strings, h->strings_size, 1) || !h->nfolders)
+                goto invalid;
+        m->folders = (const void *) ((char *) m->data + h->folders);
+        m->entries = (const void *) ((char *) m->data + h->entries);
+        m->names = (const void *) ((char *) m->data + h->names);
+        m->byname = (const void *) ((char *) m->data + h->byname);
+        m->tris = (const void *) ((char *) m->data + h->tris);
+        m->postings = (const void *) ((char *) m->data + h->postings);
+        m->strings = (const char *) m->data + h->strings;
+        if (!index_valid(m)) goto invalid;
+        return 0;
+
+invalid:
+        warn("Invalid index: %s", path);
+        index_unmap(m);
+        return -1;
+}
+
+struct crawl {
+        int generation;
+        int root; /* Folder crawled */
+        char *path;
+        struct index_map old; /* Last index, reused for unchanged folders */
+        index_folder_da folders;
+        index_entry_da entries;
+        index_name_da names;
+        struct sbuf strings;
+        u32_da intern; /* Hash table of names, INDEX_NONE if empty */
+        u32_da tmp;
+        char *buf;
+};
+
+uint32_t
+hash_name(const char *s)
+{
+        uint32_t h = 2166136261u;
+        while (*s)
+                h = (h ^ (unsigned char) *s++) * 16777619u;
+        return h;
+}
+
+/* Interned name s */
+uint32_t
+crawl_intern(struct crawl *c, const char *s)
+{
+        u32_da old;
+        uint32_t i, k, mask;
+
+        if (c->names.size * 2 >= c->intern.size) {
+                old = c->intern;
+                c->intern = (u32_da) { 0 };
+                for (i = 0; i < (old.size ? old.size * 2 : 1024); i++)
+                        da_append(&c->intern, INDEX_NONE);
+                mask = c->intern.size - 1;
+                for (i = 0; i < old.size; i++) {
+                        if (old.data[i] == INDEX_NONE) continue;
+                        k = hash_name(c->strings.data + c->names.data[old.data[i]].string) & mask;
+                        while (c->intern.data[k] != INDEX_NONE)
+                                k = (k + 1) & mask;
+                        c->intern.data[k] = old.data[i];
+                }
+                free(old.data);
+        }
+
+        mask = c->intern.size - 1;
+        for (k = hash_name(s) & mask; c->intern.data[k] != INDEX_NONE; k = (k + 1) & mask)
+                if (!strcmp(c->strings.data + c->names.data[c->intern.data[k]].string, s))
+                        return c->intern.data[k];
+        c->intern.data[k] = c->names.size;
+        da_append(&c->names, ((struct index_name) { .string = c->strings.size }));
+        sbuf_append(&c->strings, s, strlen(s) + 1);
+        return c->names.size - 1;
+}
+
+int
+crawl_name_cmp(const void *_a, const void *_b, void *_c)
+{
+        const struct index_entry *a = _a;
+        const struct index_entry *b = _b;
+        struct crawl *c = _c;
+        return strcmp(c->strings.data + c->names.data[a->name].string,
+                      c->strings.data + c->names.data[b->name].string);
+}
+
+/* Entry named name of folder f of the old index, or INDEX_NONE */
+uint32_t
+old_lookup(struct index_map *m, uint32_t f, const char *name)
+{
+        uint32_t lo = m->folders[f].first, hi = lo + m->folders[f].count, mid;
+        int cmp;
+
+        while (lo < hi) {
+                mid = lo + (hi - lo) / 2;
+                if (!(cmp = strcmp(INDEX_NAME(m, m->entries[mid].name), name))) return mid;
+                if (cmp > 0)
+                        hi = mid;
+                else
+                        lo = mid + 1;
+        }
+        return INDEX_NONE;
+}
+
+/* Read folder fd, listed as entry (INDEX_NONE for the root), to a new
+ * folder with its entries. old is the same folder in the last index, or
+ * INDEX_NONE. Return -1 if it can not be read */
+int
+crawl_read(struct crawl *c, int fd, uint32_t entry, uint32_t old)
+{
+        struct index_map *m = &c->old;
+        struct dirent64 *d;
+        struct stat st;
+        uint32_t id = c->folders.size, first = c->entries.size, k, o;
+        int64_t mtime;
+        int off, nread;
+
+        if (fstat(fd, &st)) return -1;
+        mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+        da_append(&c->folders, ((struct index_folder) { .mtime = mtime, .entry = entry, .first = first }));
+
+        /* child holds the old folder of the entry until it is crawled */
+        if (old != INDEX_NONE && m->folders[old].mtime == mtime) {
+                for (k = 0; k < m->folders[old].count; k++) {
+                        o = m->folders[old].first + k;
+                        da_append(&c->entries, ((struct index_entry) {
+                                                       .folder = id,
+                                                       .name = crawl_intern(c, INDEX_NAME(m, m->entries[o].name)),
+                                                       .child = m->entries[o].child,
+                                                       .type = m->entries[o].type,
+                                               }));
+                }
+        } else {
+                while ((nread = getdents64(fd, c->buf, GETDENTS_BUF_SIZE)) > 0) {
+                        for (off = 0; off < nread; off += d->d_reclen) {
+                                d = (struct dirent64 *) (c->buf + off);
+                                if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, "..")) continue;
+                                if (d->d_type == DT_UNKNOWN && !fstatat(fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW))
+                                        d->d_type = IFTODT(st.st_mode);
+                                o = old == INDEX_NONE ? INDEX_NONE : old_lookup(m, old, d->d_name);
+                                da_append(&c->entries, ((struct index_entry) {
+                                                               .folder = id,
+                                                               .name = crawl_intern(c, d->d_name),
+                                                               .child = o == INDEX_NONE ? INDEX_NONE : m->entries[o].child,
+                                                               .type = d->d_type,
+                                                       }));
+                        }
+                }
+                qsort_r(c->entries.data + first, c->entries.size - first,
+                        sizeof *c->entries.data, crawl_name_cmp, c);
+        }
+        c->folders.data[id].count = c->entries.size - first;
+        return 0;
+}
+
+/* Folder being crawled, with the next of its entries to go down into */
+struct crawl_frame {
+        int fd;
+        uint32_t folder;
+        uint32_t next;
+};
+
+/* Crawl the tree of folder fd depth first, the folders being crawled kept
+ * in a stack instead of the thread stack, as trees can be deep. old is the
+ * root in the last index, or INDEX_NONE. Return 0 if canceled */
+int
+crawl_folder(struct crawl *c, int fd, uint32_t old)
+{
+        DA(struct crawl_frame) stack = { 0 };
+        struct crawl_frame *top;
+        struct index_entry *e;
+        const char *name;
+        uint32_t i, k, o;
+        int sub, canceled = 0;
+
+        if (!crawl_read(c, fd, INDEX_NONE, old))
+                da_append(&stack, ((struct crawl_frame) { -1, 0, c->folders.data[0].first }));
+        while (stack.size) {
+                top = &stack.data[stack.size - 1];
+                if (__atomic_load_n(&file_index.generation, __ATOMIC_ACQUIRE) != c->generation) {
+                        canceled = 1;
+                        break;
+                }
+                if (top->next == c->folders.data[top->folder].first + c->folders.data[top->folder].count) {
+                        c->folders.data[top->folder].last = c->folders.size;
+                        if (top->fd >= 0) close(top->fd);
+                        stack.size--;
+                        continue;
+                }
+                i = top->next++;
+                e = &c->entries.data[i];
+                o = e->child;
+                e->child = INDEX_NONE;
+                if (e->type != DT_DIR) continue;
+                name = c->strings.data + c->names.data[e->name].string;
+                sub = openat(top->fd >= 0 ? top->fd : fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                if (sub < 0) {
+                        /* A descriptor is kept by level */
+                        if (errno == EMFILE || errno == ENFILE)
+                                warn("Folder `%s` too deep to be indexed, %d levels down", name, stack.size);
+                        continue;
+                }
+                k = c->folders.size;
+                if (crawl_read(c, sub, i, o)) {
+                        close(sub);
+                        continue;
+                }
+                c->entries.data[i].child = k;
+                da_append(&stack, ((struct crawl_frame) { sub, k, c->folders.data[k].first }));
+        }
+        for (i = 0; i < stack.size; i++)
+                if (stack.data[i].fd >= 0) close(stack.data[i].fd);
+        free(stack.data);
+        return !canceled;
+}
+
+/* Distinct trigrams of s, lowercase, to tris. Return how many */
+int
+name_trigrams(const char *s, uint32_t *tris)
+{
+        int i, k, n = 0, len = strlen(s);
+        uint32_t t;
+
+        for (i = 0; i + 2 < len; i++) {
+                t = tolower((unsigned char) s[i]) << 16 |
+                    tolower((unsigned char) s[i + 1]) << 8 |
+                    tolower((unsigned char) s[i + 2]);
+                for (k = 0; k < n && tris[k] != t; k++)
+                        ;
+                if (k == n) tris[n++] = t;
+        }
+        return n;
+}
+
+/* Write size bytes at offset *off, aligned to 8 bytes */
+int
+write_section(int fd, uint64_t *off, const void *data, uint64_t size)
+{
+        static const char zero[8] = { 0 };
+        uint64_t pad = -*off & 7;
+
+        if (pad && write(fd, zero, pad) != (ssize_t) pad) return -1;
+        *off += pad;
+        if (size && write(fd, data, size) != (ssize_t) size) return -1;
+        *off += size;
+        return 0;
+}
+
+/* Build the names and trigrams sections, and write the index */
+int
+crawl_write(struct crawl *c)
+{
+        struct index_header h = { .magic = INDEX_MAGIC };
+        DA(struct index_tri) tris = { 0 };
+        u32_da byname = { 0 }, postings = { 0 };
+        uint32_t *count, t[256], i, k, n;
+        uint64_t off;
+        char *tmp;
+        int fd, ret = -1;
+
+        /* Entries by name, with a counting sort */
+        for (i = 0; i < c->entries.size; i++)
+                c->names.data[c->entries.data[i].name].count++;
+        for (i = 0, n = 0; i < c->names.size; i++) {
+                c->names.data[i].first = n;
+                n += c->names.data[i].count;
+                c->names.data[i].count = 0;
+        }
+        for (i = 0; i < c->entries.size; i++)
+                da_append(&byname, 0);
+        for (i = 0; i < c->entries.size; i++) {
+                k = c->entries.data[i].name;
+                byname.data[c->names.data[k].first + c->names.data[k].count++] = i;
+        }
+
+        /* Names by trigram, with a counting sort too */
+        if (!(count = calloc(INDEX_TRIS, sizeof *count))) return -1;
+        for (i = 0; i < c->names.size; i++) {
+                n = name_trigrams(c->strings.data + c->names.data[i].string, t);
+                for (k = 0; k < n; k++)
+                        count[t[k]]++;
+        }
+        for (i = 0, n = 0; i < INDEX_TRIS; i++) {
+                if (!count[i]) continue;
+                da_append(&tris, ((struct index_tri) { .tri = i, .start = n }));
+                n += count[i];
+                count[i] = tris.size; /* 1 + index in tris */
+        }
+        for (i = 0; i < n; i++)
+                da_append(&postings, 0);
+        for (i = 0; i < c->names.size; i++) {
+                n = name_trigrams(c->strings.data + c->names.data[i].string, t);
+                for (k = 0; k < n; k++) {
+                        struct index_tri *tri = &tris.data[count[t[k]] - 1];
+                        postings.data[tri->start + tri->count++] = i;
+                }
+        }
+        free(count);
+
+        h.nfolders = c->folders.size;
+        h.nentries = c->entries.size;
+        h.nnames = c->names.size;
+        h.ntris = tris.size;
+        h.npostings = postings.size;
+
+        /* Other fl in the same working directory write it too */
+        tmp = strconcat(c->path, ".XXXXXX");
+        if ((fd = mkostemp(tmp, O_CLOEXEC)) < 0) {
+                error("Can not write index %s", tmp);
+                goto out;
+        }
+        /* The header is written last, once the offsets are known */
+        off = sizeof h;
+        if (lseek(fd, off, SEEK_SET) < 0) goto fail;
+        h.folders = (off + 7) & ~7ULL;
+        if (write_section(fd, &off, c->folders.data, h.nfolders * sizeof *c->folders.data)) goto fail;
+        h.entries = (off + 7) & ~7ULL;
+        if (write_section(fd, &off, c->entries.data, h.nentries * sizeof *c->entries.data)) goto fail;
+        h.names = (off + 7) & ~7ULL;
+        if (write_section(fd, &off, c->names.data, h.nnames * sizeof *c->names.data)) goto fail;
+        h.byname = (off + 7) & ~7ULL;
+        if (write_section(fd, &off, byname.data, h.nentries * sizeof *byname.data)) goto fail;
+        h.tris = (off + 7) & ~7ULL;
+        if (write_section(fd, &off, tris.data, h.ntris * sizeof *tris.data)) goto fail;
+        h.postings = (off + 7) & ~7ULL;
+        if (write_section(fd, &off, postings.data, h.npostings * sizeof *postings.data)) goto fail;
+        h.strings = (off + 7) & ~7ULL;
+        h.strings_size = c->strings.size;
+        if (write_section(fd, &off, c->strings.data, h.strings_size)) goto fail;
+        if (pwrite(fd, &h, sizeof h, 0) != sizeof h) goto fail;
+        if (close(fd)) {
+                fd = -1;
+                goto fail;
+        }
+        fd = -1;
+        if (rename(tmp, c->path)) goto fail;
+        ret = 0;
+        goto out;
+
+fail:
+        error("Can not write index %s", tmp);
+        if (fd >= 0) close(fd);
+        unlink(tmp);
+out:
+        free(tmp);
+        free(tris.data);
+        free(byname.data);
+        free(postings.data);
+        return ret;
+}
+
+void *
+crawl_thread(void *arg)
+{
+        struct crawl *c = arg;
+
+        if (crawl_folder(c, c->root, c->old.data ? 0 : INDEX_NONE) &&
+            !crawl_write(c) &&
+            __atomic_load_n(&file_index.generation, __ATOMIC_ACQUIRE) == c->generation) {
+                info("Index written: %d folders, %d entries", c->folders.size, c->entries.size);
+                __atomic_store_n(&file_index.ready, 1, __ATOMIC_RELEASE);
+                if (write(posts.efd, &(uint64_t) { 1 }, sizeof(uint64_t)) < 0)
+                        error("Can not wake up main thread");
+        }
+
+        close(c->root);
+        index_unmap(&c->old);
+        free(c->path);
+        free(c->folders.data);
+        free(c->entries.data);
+        free(c->names.data);
+        free(c->strings.data);
+        free(c->intern.data);
+        free(c->buf);
+        free(c);
+        return NULL;
+}
+
+/* Map the index of the working directory, and crawl it again in background.
+ * A crawl of the previous working directory is stopped. */
+void
+index_start()
+{
+        static char *home = NULL;
+        char cwd[PATH_MAX], name[32];
+        struct crawl *c;
+        pthread_t thread;
+
+        if (!file_index.enabled) return;
+        __atomic_add_fetch(&file_index.generation, 1, __ATOMIC_ACQ_REL);
+        __atomic_store_n(&file_index.ready, 0, __ATOMIC_RELEASE);
+        index_unmap(&file_index.map);
+        free(file_index.path);
+        file_index.path = NULL;
+
+        if (!home && !(home = getenv("HOME"))) {
+                report("Can not get env `HOME`: index disabled");
+                file_index.enabled = 0;
+                return;
+        }
+        if (!getcwd(cwd, sizeof cwd)) {
+                error("Can not get working directory");
+                return;
+        }
+        snprintf(name, sizeof name, "%08x.idx", hash_name(cwd));
+        file_index.path = strconcat(home, "/" INDEX_DIR "/", name);
+        if (create_filename_path_if_not_exists(file_index.path)) return;
+        index_map(file_index.path, &file_index.map);
+
+        c = calloc(1, sizeof *c);
+        assert(c);
+        c->generation = file_index.generation;
+        c->path = strdup(file_index.path);
+        c->buf = malloc(GETDENTS_BUF_SIZE);
+        assert(c->buf);
+        /* The crawler maps the index on its own, as the main thread unmaps
+         * it when the working directory changes */
+        index_map(c->path, &c->old);
+        if ((c->root = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0 ||
+            pthread_create(&thread, NULL, crawl_thread, c)) {
+                error("Can not crawl working directory");
+                if (c->root >= 0) close(c->root);
+                index_unmap(&c->old);
+                free(c->path);
+                free(c->buf);
+                free(c);
+                return;
+        }
+        pthread_detach(thread);
+}
+
+/* Map the index written by the crawler, if it is done */
+int
+index_poll()
+{
+        if (!__atomic_exchange_n(&file_index.ready, 0, __ATOMIC_ACQ_REL)) return 0;
+        index_unmap(&file_index.map);
+        index_map(file_index.path, &file_index.map);
+        return 1;
+}
+
+/* Path of entry i, relative to the working directory like the view paths */
+const char *
+index_path(struct index_map *m, uint32_t i, struct sbuf *sb)
+{
+        uint32_t stack[PATH_MAX / 2];
+        int n = 0;
+
+        for (; i != INDEX_NONE && n < (int) (sizeof stack / sizeof *stack);
+             i = m->folders[m->entries[i].folder].entry)
+                stack[n++] = i;
+        sb->size = 0;
+        sbuf_append(sb, ".", 1);
+        while (n--) {
+                sbuf_append(sb, "/", 1);
+                sbuf_puts(sb, INDEX_NAME(m, m->entries[stack[n]].name));
+        }
+        sbuf_append(sb, "", 1);
+        sb->size--;
+        return sb->data;
+}
+
+struct index_range {
+        uint32_t start;
+        uint32_t end;
+};
+
+typedef DA(struct index_range) index_range_da;
+
+int
+range_cmp(const void *_a, const void *_b)
+{
+        const struct index_range *a = _a;
+        const struct index_range *b = _b;
+        if (a->start != b->start) return a->start < b->start ? -1 : 1;
+        return 0;
+}
+
+/* Entries in the index matching the search pattern, to hits. Only the
+ * names with the literal of the pattern, found by its trigrams, and the
+ * subtrees of the folders with those names are matched. */
+void
+index_search(u32_da *hits)
+{
+        static struct sbuf path = { 0 };
+        static index_range_da ranges = { 0 };
+        struct index_map *m = &file_index.map;
+        const struct index_name *name;
+        const struct index_entry *e;
+        const struct index_folder *f;
+        const uint32_t *list;
+        uint32_t i, k, n, lo, hi, mid, end;
+        const char *lit = finder.lit, *s;
+        int litlen = finder.litlen;
+
+        hits->size = 0;
+        if (!m->data) return;
+
+        /* A literal with / spans several names: use its longest part */
+        for (s = lit, lit = NULL, litlen = 0; s < finder.lit + finder.litlen; s += k + 1) {
+                for (k = 0; s + k < finder.lit + finder.litlen && s[k] != '/'; k++)
+                        ;
+                if ((int) k > litlen) {
+                        lit = s;
+                        litlen = k;
+                }
+        }
+
+        ranges.size = 0;
+        if (litlen < 3) {
+                da_append(&ranges, ((struct index_range) { 0, m->h->nentries }));
+        } else {
+                /* Names with the trigram with the shortest list */
+                list = NULL;
+                n = 0;
+                for (i = 0; i + 2 < (uint32_t) litlen; i++) {
+                        k = (unsigned char) lit[i] << 16 | (unsigned char) lit[i + 1] << 8 |
+                            (unsigned char) lit[i + 2];
+                        lo = 0;
+                        hi = m->h->ntris;
+                        while (lo < hi) {
+                                mid = lo + (hi - lo) / 2;
+                                if (m->tris[mid].tri < k)
+                                        lo = mid + 1;
+                                else
+                                        hi = mid;
+                        }
+                        if (lo == m->h->ntris || m->tris[lo].tri != k) return;
+                        if (!list || m->tris[lo].count < n) {
+                                list = m->postings + m->tris[lo].start;
+                                n = m->tris[lo].count;
+                        }
+                }
+                for (i = 0; i < n; i++) {
+                        name = &m->names[list[i]];
+                        s = m->strings + name->string;
+                        if (!search_find(s, strlen(s), lit, litlen)) continue;
+                        for (k = 0; k < name->count; k++) {
+                                e = &m->entries[m->byname[name->first + k]];
+                                da_append(&ranges, ((struct index_range) { m->byname[name->first + k],
+                                                                           m->byname[name->first + k] + 1 }));
+                                if (e->child == INDEX_NONE) continue;
+                                f = &m->folders[e->child];
+                                end = f->last < m->h->nfolders ? m->folders[f->last].first : m->h->nentries;
+                                da_append(&ranges, ((struct index_range) { f->first, end }));
+                        }
+                }
+                qsort(ranges.data, ranges.size, sizeof *ranges.data, range_cmp);
+        }
+
+        for (i = 0, end = 0; i < ranges.size; i++) {
+                k = ranges.data[i].start > end ? ranges.data[i].start : end;
+                for (; k < ranges.data[i].end; k++) {
+                        index_path(m, k, &path);
+                        if (finder.plain ? search_find(path.data, path.size, finder.lit, finder.litlen) :
+                                           !regexec(&finder.regex, path.data, 0, NULL, 0))
+                                da_append(hits, k);
+                }
+                if (ranges.data[i].end > end) end = ranges.data[i].end;
+        }
+}
+
+/* Filter. While there is a query, only the rows whose name contains it are
+ * shown; if fuzzy, the rows whose name has its chars in order, best matches
+ * first. Results are kept for the last queries typed: a longer query only
+ * filters the results of the previous one, and going back to a shorter one
+ * takes its results again. Long lists are filtered in chunks by the main
+ * thread and the pool. */
+#define FILTER_CHUNK (1 << 14)
+
+struct filter_match {
+        int row;
+        int score;
+};
+
+typedef DA(struct filter_match) match_da;
+
+struct filter_level {
+        int len; /* Query length */
+        match_da matches;
+};
+
+typedef DA(struct filter_level) level_da;
+
+struct filter_chunk {
+        const struct filter_match *in; /* NULL to filter view rows */
+        const int *rows;               /* Entries of the view rows */
+        int start;
+        int n;
+        match_da out;
+};
+
+struct {
+        int active; /* There is a query */
+        int fuzzy;
+        char query[1024];
+        char lower[1024]; /* Query in lowercase */
+        int len;
+        level_da levels;  /* Results, by increasing query length */
+        unsigned version; /* view_version the results are for */
+        int pos;          /* Position of the selection in the results */
+        int woffset;      /* Position of the first row in the window */
+} filter = { 0 };
+
+/* Chunks of the filter running. The main thread and the pool workers take
+ * them in turn, so a keystroke never waits for other tasks queued to the
+ * pool, only for the chunks being filtered. Workers that get to it late
+ * find nothing left, or help the next run */
+struct {
+        pthread_mutex_t lock;
+        pthread_cond_t done;       /* Signaled when no chunk is running */
+        struct filter_chunk *data;
+        int size;                  /* Chunks of the run */
+        int capacity;
+        int next;                  /* First chunk not taken */
+        int running;               /* Taken and not done */
+        int queued;                /* Workers asked to help, not started */
+        struct task_group group;   /* Never waited for */
+} filter_chunks = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .done = PTHREAD_COND_INITIALIZER,
+};
+
+/* Score name, of n bytes, as a fuzzy match of q: its chars must be found in
+ * name in order, ignoring case. Consecutive chars and chars starting a word
+ * score more, gaps between them less. Return -1 if it does not match. */
+int
+fuzzy_score(const char *name, int n, const char *q, int qlen)
+{
+        int i, j = 0, last = NONE, score = 0;
+
+        for (i = 0; i < n && j < qlen; i++) {
+                if (tolower((unsigned char) name[i]) != q[j]) continue;
+                score += 16;
+                if (last == i - 1)
+                        score += 16;
+                else if (last != NONE)
+                        score -= i - last - 1 < 8 ? i - last - 1 : 8;
+                if (!i || strchr("/_-. ", name[i - 1])) score += 8;
+                last = i;
+                j++;
+        }
+        return j == qlen ? score : -1;
+}
+
+void
+filter_chunk(void *arg)
+{
+        struct filter_chunk *c = arg;
+        struct filter_match m;
+        struct entry *e;
+        int i;
+
+        c->out.size = 0;
+        for (i = 0; i < c->n; i++) {
+                m.row = c->in ? c->in[c->start + i].row : c->start + i;
+                e = &entries.data[c->rows[m.row]];
+                if (filter.fuzzy)
+                        m.score = fuzzy_score(NAME(e), e->namelen, filter.lower, filter.len);
+                else
+                        m.score = search_find(NAME(e), e->namelen, filter.lower, filter.len) - 1;
+                if (m.score >= 0) da_append(&c->out, m);
+        }
+}
+
+int
+filter_cmp(const void *_a, const void *_b)
+{
+        const struct filter_match *a = _a;
+        const struct filter_match *b = _b;
+        if (a->score != b->score) return a->score > b->score ? -1 : 1;
+        return a->row - b->row;
+}
+
+/* Filter the chunks not taken yet */
+void
+filter_take(void *arg)
+{
+        struct filter_chunk *c;
+
+        pthread_mutex_lock(&filter_chunks.lock);
+        if (arg) filter_chunks.queued--;
+        while (filter_chunks.next < filter_chunks.size) {
+                c = &filter_chunks.data[filter_chunks.next++];
+                filter_chunks.running++;
+                pthread_mutex_unlock(&filter_chunks.lock);
+                filter_chunk(c);
+                pthread_mutex_lock(&filter_chunks.lock);
+                if (!--filter_chunks.running) pthread_cond_signal(&filter_chunks.done);
+        }
+        pthread_mutex_unlock(&filter_chunks.lock);
+}
+
+/* Filter n matches of in (the view rows if NULL) to out */
+void
+filter_run(const struct filter_match *in, int n, match_da *out)
+{
+        struct filter_chunk *chunks;
+        const int *rows = view_rows();
+        int i, j, helpers, k = (n + FILTER_CHUNK - 1) / FILTER_CHUNK;
+
+        pthread_mutex_lock(&filter_chunks.lock);
+        if (k > filter_chunks.capacity) {
+                filter_chunks.data = realloc(filter_chunks.data, k * sizeof *filter_chunks.data);
+                assert(filter_chunks.data);
+                memset(filter_chunks.data + filter_chunks.capacity, 0,
+                       (k - filter_chunks.capacity) * sizeof *filter_chunks.data);
+                filter_chunks.capacity = k;
+        }
+        chunks = filter_chunks.data;
+        for (i = 0; i < k; i++) {
+                chunks[i].in = in;
+                chunks[i].rows = rows;
+                chunks[i].start = i * FILTER_CHUNK;
+                chunks[i].n = i == k - 1 ? n - i * FILTER_CHUNK : FILTER_CHUNK;
+        }
+        filter_chunks.size = k;
+        filter_chunks.next = 0;
+        /* Workers still queued from before help this run too */
+        helpers = k - 1 - filter_chunks.queued;
+        if (helpers > 0) filter_chunks.queued += helpers;
+        pthread_mutex_unlock(&filter_chunks.lock);
+
+        for (i = 0; i < helpers; i++)
+                pool_submit(&filter_chunks.group, filter_take, &filter_chunks);
+        filter_take(NULL);
+        pthread_mutex_lock(&filter_chunks.lock);
+        while (filter_chunks.running)
+                pthread_cond_wait(&filter_chunks.done, &filter_chunks.lock);
+        pthread_mutex_unlock(&filter_chunks.lock);
+
+        out->size = 0;
+        for (i = 0; i < k; i++)
+                for (j = 0; j < chunks[i].out.size; j++)
+                        da_append(out, chunks[i].out.data[j]);
+        if (filter.fuzzy) qsort(out->data, out->size, sizeof *out->data, filter_cmp);
+}
+
+void
+filter_pop()
+{
+        free(filter.levels.data[--filter.levels.size].matches.data);
+}
+
+/* Bring the results up to date with the query and the view */
+void
+filter_update()
+{
+        struct filter_level level = { .len = filter.len };
+        struct filter_level *top;
+        long long start;
+
+        if (filter.version != view_version) {
+                while (filter.levels.size)
+                        filter_pop();
+                filter.version = view_version;
+        }
+        while (filter.levels.size && filter.levels.data[filter.levels.size - 1].len > filter.len)
+                filter_pop();
+        if (!filter.len) return;
+
+        top = filter.levels.size ? &filter.levels.data[filter.levels.size - 1] : NULL;
+        if (top && top->len == filter.len) return;
+        start = perf_start();
+        if (top)
+                filter_run(top->matches.data, top->matches.size, &level.matches);
+        else
+                filter_run(NULL, view.size, &level.matches);
+        perf_end(PERF_FILTER, start, top ? top->matches.size : view.size);
+        da_append(&filter.levels, level);
+}
+
+/* Set the query. Results of the queries it starts with are kept */
+void
+filter_set(const char *query)
+{
+        int i;
+
+        for (i = 0; i < filter.len && query[i] == filter.query[i]; i++)
+                ;
+        while (filter.levels.size && filter.levels.data[filter.levels.size - 1].len > i)
+                filter_pop();
+
+        snprintf(filter.query, sizeof filter.query, "%s", query);
+        filter.len = strlen(filter.query);
+        for (i = 0; i <= filter.len; i++)
+                filter.lower[i] = tolower((unsigned char) filter.query[i]);
+        filter.active = filter.len > 0;
+        filter.pos = 0;
+        filter.woffset = 0;
+        filter_update();
+}
+
+void
+filter_toggle_fuzzy()
+{
+        while (filter.levels.size)
+                filter_pop();
+        filter.fuzzy = !filter.fuzzy;
+        filter_update();
+}
+
+/* Update the results, and the position of the selection in them. If the
+ * selected row is not shown, the one at its position is selected. */
+void
+filter_sync()
+{
+        match_da *m;
+        int i;
+
+        if (!filter.active) return;
+        filter_update();
+        m = &filter.levels.data[filter.levels.size - 1].matches;
+        if (filter.pos < m->size && m->data[filter.pos].row == selected_row) return;
+        for (i = 0; i < m->size && m->data[i].row != selected_row; i++)
+                ;
+        if (i < m->size) {
+                filter.pos = i;
+                return;
+        }
+        if (filter.pos >= m->size) filter.pos = m->size - 1;
+        if (filter.pos < 0) filter.pos = 0;
+        if (m->size) selected_row = m->data[filter.pos].row;
+}
+
+/* Rows shown, and the selection, by position: every row in view, or the
+ * filter results */
+int
+shown_count()
+{
+        filter_sync();
+        return filter.active ? filter.levels.data[filter.levels.size - 1].matches.size : view.size;
+}
+
+int
+shown_row(int pos)
+{
+        return filter.active ? filter.levels.data[filter.levels.size - 1].matches.data[pos].row : pos;
+}
+
+int
+cursor_pos()
+{
+        filter_sync();
+        return filter.active ? filter.pos : selected_row;
+}
+
+void
+cursor_set(int pos)
+{
+        int count = shown_count();
+
+        if (pos >= count) pos = count - 1;
+        if (pos < 0) pos = 0;
+        if (filter.active) {
+                filter.pos = pos;
+                if (count) selected_row = shown_row(pos);
+        } else
+                selected_row = pos;
+}
+
+/* Marks. Batch operations act on the marked entries, or on the selected one
+ * if there are none */
+int mark_anchor = NONE; /* Entry last marked by hand */
+
+void
+mark_set(int row, int on)
+{
+        struct entry *e = &ROW(row);
+
+        if (e->marked == on) return;
+        e->marked = on;
+        marked_count += on ? 1 : -1;
+}
+
+void
+mark_clear()
+{
+        int i;
+
+        for (i = 0; marked_count && i < entries.size; i++) {
+                if (!entries.data[i].marked) continue;
+                entries.data[i].marked = 0;
+                --marked_count;
+        }
+        mark_anchor = NONE;
+}
+
+/* Toggle the mark of the selected entry and select the next one */
+void
+mark_toggle()
+{
+        if (!shown_count()) return;
+        mark_set(selected_row, !ROW(selected_row).marked);
+        mark_anchor = view_at(selected_row);
+        cursor_set(cursor_pos() + 1);
+}
+
+/* Mark the entries shown from the one last marked to the selected one, or
+ * just the selected one */
+void
+mark_range()
+{
+        int pos, from = NONE, to = cursor_pos(), count = shown_count();
+
+        if (!count) return;
+        if (mark_anchor != NONE && entries.data[mark_anchor].parent != NONE) {
+                if (!filter.active)
+                        from = entry_row(mark_anchor);
+                else
+                        for (pos = 0; pos < count; pos++)
+                                if (view_at(shown_row(pos)) == mark_anchor) from = pos;
+        }
+        if (from == NONE) from = to;
+        if (from > to) {
+                pos = from;
+                from = to;
+                to = pos;
+        }
+        for (pos = from; pos <= to; pos++)
+                mark_set(shown_row(pos), 1);
+        mark_anchor = view_at(selected_row);
+}
+
+/* Mark the entries the filter shows, or else the search matches */
+void
+mark_matches()
+{
+        int i;
+
+        if (filter.active) {
+                for (i = 0; i < shown_count(); i++)
+                        mark_set(shown_row(i), 1);
+                return;
+        }
+        if (!finder.compiled || finder.global) return;
+        if (!finder.valid || finder.version != view_version) search_run();
+        for (i = 0; i < finder.rows.size; i++)
+                mark_set(finder.rows.data[i], 1);
+}
+
+/* Path to select once it is read, as ./a/b/c. The folders leading to it
+ * are expanded one by one as they are read. */
+char *reveal_path = NULL;
+
+/* Expand the next folder leading to reveal_path, or select it once it is
+ * in view */
+void
+reveal_step()
+{
+        const char *name, *end;
+        int_da *children;
+        int i, n, e = NONE, row;
+
+        if (!reveal_path) return;
+        for (i = 0; i < roots.size && strcmp(nodes.data[roots.data[i]].path, "."); i++)
+                ;
+        if (i == roots.size) goto done;
+
+        for (n = roots.data[i], name = reveal_path + 2;; name = end + 1) {
+                end = strchrnul(name, '/');
+                children = &nodes.data[n].children;
+                for (i = 0; i < children->size; i++) {
+                        e = children->data[i];
+                        if (entries.data[e].namelen == end - name &&
+                            !memcmp(NAME(&entries.data[e]), name, end - name))
+                                break;
+                }
+                if (i == children->size) {
+                        /* Wait for the rest of the folder */
+                        if (nodes.data[n].listing) return;
+                        goto done;
+                }
+                if (entries.data[e].node != NONE && *end) {
+                        n = entries.data[e].node;
+                        continue;
+                }
+
+                row = entry_row(e);
+                if (!*end) {
+                        if (filter.active) filter_set("");
+                        selected_row = row;
+                        cursor_pending = 0;
+                        goto done;
+                }
+                if (!is_folder(&entries.data[e])) goto done;
+                add_subfolder(row, 1);
+                return;
+        }
+
+done:
+        free(reveal_path);
+        reveal_path = NULL;
+}
+
+/* Select the next (dir > 0) or previous (dir < 0) match in the index. The
+ * folders leading to it are expanded as needed. */
+void
+search_index(int dir)
+{
+        static struct sbuf path = { 0 };
+        int size;
+
+        if (!file_index.map.data) {
+                if (finder.global) warn("No index: run fl with --index");
+                return;
+        }
+        if (!finder.hits_valid) {
+                index_search(&finder.hits);
+                finder.hits_valid = 1;
+                finder.hit = dir > 0 ? -1 : 0;
+        }
+        if (!(size = finder.hits.size)) return;
+
+        finder.hit = (finder.hit + dir + size) % size;
+        free(reveal_path);
+        reveal_path = strdup(index_path(&file_index.map, finder.hits.data[finder.hit], &path));
+        reveal_step();
+}
+
+/* Batches of path syscalls are sent to the kernel through io_uring, a ring
+ * of requests shared with it, so thousands of renames cost a few syscalls.
+ * Where it is not available, or does not know an op, they are done one by
+ * one. */
+#define URING_ENTRIES 256
+#define URING_UNAVAILABLE -2
+
+struct uring_op {
+        int opcode; /* IORING_OP_RENAMEAT, IORING_OP_UNLINKAT or IORING_OP_STATX */
+        int dirfd;
+        const char *path;
+        int dirfd2; /* Destination of renames */
+        const char *path2;
+        int flags;
+        struct statx *stx; /* statx result */
+        int res;           /* 0, or -errno */
+};
+
+typedef DA(struct uring_op) uring_op_da;
+
+struct uring {
+        int fd; /* -1 if not set up yet */
+        unsigned entries;
+        unsigned *sq_tail, *sq_mask, *sq_array;
+        unsigned *cq_head, *cq_tail, *cq_mask;
+        struct io_uring_sqe *sqes;
+        struct io_uring_cqe *cqes;
+};
+
+/* Each thread doing batches has its own ring */
+static __thread struct uring ring = { .fd = -1 };
+
+int
+uring_setup(struct uring *r)
+{
+        struct io_uring_params p = { 0 };
+        size_t sq_size, cq_size;
+        char *sq, *cq;
+
+        if (r->fd != -1) return r->fd >= 0 ? 0 : -1;
+        if ((r->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) < 0) {
+                r->fd = URING_UNAVAILABLE;
+                return -1;
+        }
+        sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP && cq_size > sq_size) sq_size = cq_size;
+        sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+        cq = p.features & IORING_FEAT_SINGLE_MMAP ?
+             sq :
+             mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+        if (sq == MAP_FAILED || cq == MAP_FAILED || r->sqes == MAP_FAILED) {
+                /* The mappings are released with the ring */
+                close(r->fd);
+                r->fd = URING_UNAVAILABLE;
+                return -1;
+        }
+        r->entries = p.sq_entries;
+        r->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+        r->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+        r->sq_array = (unsigned *) (sq + p.sq_off.array);
+        r->cq_head = (unsigned *) (cq + p.cq_off.head);
+        r->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+        r->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+        r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+        return 0;
+}
+
+/* Do op with a plain syscall. Return 0 or -errno */
+int
+uring_sys(struct uring_op *op)
+{
+        int ret = -1;
+
+        switch (op->opcode) {
+        case IORING_OP_RENAMEAT:
+                ret = renameat2(op->dirfd, op->path, op->dirfd2, op->path2, op->flags);
+                break;
+        case IORING_OP_UNLINKAT:
+                ret = unlinkat(op->dirfd, op->path, op->flags);
+                break;
+        case IORING_OP_STATX:
+                ret = statx(op->dirfd, op->path, op->flags, STATX_BASIC_STATS, op->stx);
+                break;
+        default:
+                errno = EINVAL;
+        }
+        return ret ? -errno : 0;
+}
+
+void
+uring_prep(struct io_uring_sqe *sqe, struct uring_op *op, int id)
+{
+        memset(sqe, 0, sizeof *sqe);
+        sqe->opcode = op->opcode;
+        sqe->fd = op->dirfd;
+        sqe->addr = (uintptr_t) op->path;
+        sqe->user_data = id;
+        switch (op->opcode) {
+        case IORING_OP_RENAMEAT:
+                sqe->len = op->dirfd2;
+                sqe->addr2 = (uintptr_t) op->path2;
+                sqe->rename_flags = op->flags;
+                break;
+        case IORING_OP_UNLINKAT:
+                sqe->unlink_flags = op->flags;
+                break;
+        case IORING_OP_STATX:
+                sqe->len = STATX_BASIC_STATS;
+                sqe->off = (uintptr_t) op->stx;
+                sqe->statx_flags = op->flags;
+                break;
+        }
+}
+
+/* Send ops[0..k) in a single submission and wait for all of them. Return -1
+ * if nothing could be submitted. If the kernel fails after taking some, the
+ * rest are done with plain syscalls. Never return with ops in flight. */
+int
+uring_submit(struct uring_op *ops, int k)
+{
+        unsigned tail = *ring.sq_tail, head, i, idx;
+        int ret, sent = 0, done = 0, busy = 0, failed = 0;
+        struct io_uring_cqe *cqe;
+
+        for (i = 0; i < k; i++) {
+                idx = (tail + i) & *ring.sq_mask;
+                uring_prep(&ring.sqes[idx], &ops[i], i);
+                ring.sq_array[idx] = idx;
+                ops[i].res = -EIO; /* If it never completes */
+        }
+        __atomic_store_n(ring.sq_tail, tail + k, __ATOMIC_RELEASE);
+
+        while (done < k) {
+                /* While the kernel is busy, only wait for what it has. Busy
+                 * with nothing of ours, it is not going to get better */
+                ret = syscall(__NR_io_uring_enter, ring.fd, busy ? 0 : k - sent,
+                              busy ? sent - done : k - done, IORING_ENTER_GETEVENTS, NULL, 0);
+                busy = 0;
+                if (ret > 0) sent += ret;
+                if (ret < 0 && (errno == EAGAIN || errno == EBUSY) && sent > done) {
+                        busy = 1;
+                } else if (ret < 0 && errno != EINTR) {
+                        if (!sent) {
+                                /* Not read by the kernel: take the requests back */
+                                __atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+                                return -1;
+                        }
+                        if (sent == k) {
+                                /* The kernel may still use the buffers of
+                                 * the ops read: wait for them whatever it
+                                 * takes, their completions are in the ring
+                                 * even if io_uring_enter fails */
+                                if (!failed++) error("Can not wait for io_uring completions");
+                                nanosleep(&(struct timespec) { .tv_nsec = 1000000 }, NULL);
+                        } else {
+                                /* The kernel reads them in order: the ones
+                                 * not read are taken back, and the others
+                                 * waited for */
+                                __atomic_store_n(ring.sq_tail, tail + sent, __ATOMIC_RELEASE);
+                                for (i = sent; i < k; i++)
+                                        ops[i].res = uring_sys(&ops[i]);
+                                k = sent;
+                        }
+                }
+                head = *ring.cq_head;
+                while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+                        cqe = &ring.cqes[head++ & *ring.cq_mask];
+                        ops[cqe->user_data].res = cqe->res;
+                        done++;
+                }
+                __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+        }
+        return 0;
+}
+
+/* Do the n ops, setting their res. Return how many failed */
+int
+uring_run(struct uring_op *ops, int n)
+{
+        int i, j, k, failed = 0;
+
+        /* Every op is counted as a syscall, even if they are sent together */
+        if (perf_scope != NONE) perf_add(perf_scope, syscalls, n);
+        if (uring_setup(&ring)) {
+                for (i = 0; i < n; i++)
+                        ops[i].res = uring_sys(&ops[i]);
+        } else {
+                for (i = 0; i < n; i += k) {
+                        k = n - i < URING_ENTRIES ? n - i : URING_ENTRIES;
+                        if (uring_submit(ops + i, k))
+                                for (j = i; j < i + k; j++)
+                                        ops[j].res = uring_sys(&ops[j]);
+                }
+        }
+        for (i = 0; i < n; i++) {
+                /* Old kernels do not know every op */
+                if (ops[i].res == -EINVAL || ops[i].res == -EOPNOTSUPP) ops[i].res = uring_sys(&ops[i]);
+                if (ops[i].res) failed++;
+        }
+        return failed;
+}
+
+/* Metadata columns. Rows shown without metadata are read with statx by the
+ * pool, in batches sent through io_uring, and posted back to the main
+ * thread: drawing never waits for a stat, however slow the filesystem is.
+ * After the rows shown, the rest of the view is read META_BATCH entries at
+ * a time, so sorting by size or mtime finds it. Folder events mark entries
+ * stale to be read again, and `r` marks them all. */
+#define META_BATCH 1024
+#define META_WIDTH 39 /* Of the columns, with the space after them */
+
+struct meta_request {
+        int entry;
+        unsigned gen;
+        int path; /* Offset in the batch paths */
+        struct statx stx;
+        int res;
+};
+
+typedef DA(struct meta_request) meta_request_da;
+
+struct meta_batch {
+        meta_request_da requests;
+        struct sbuf paths;
+};
+
+typedef DA(struct meta_batch *) meta_batch_da;
+
+/* User names by uid, filled by the workers */
+struct owner {
+        unsigned uid;
+        char name[32];
+};
+
+typedef DA(struct owner) owner_da;
+
+struct {
+        int columns; /* Shown */
+        pthread_mutex_t lock;
+        meta_batch_da done;      /* Read, to be merged by the main thread */
+        owner_da owners;
+        struct task_group group;
+        struct meta_batch *next; /* Being filled by the main thread */
+        int inflight;            /* Batches submitted and not merged */
+        int scan;                /* Next view row to read in background */
+        unsigned version;        /* view_version of the scan */
+} metadata = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* Name of uid, to name (size 32). 0 if it is not known yet */
+int
+owner_name(unsigned uid, char *name)
+{
+        int i, found = 0;
+
+        pthread_mutex_lock(&metadata.lock);
+        for (i = 0; i < metadata.owners.size && !found; i++)
+                if (metadata.owners.data[i].uid == uid) {
+                        memcpy(name, metadata.owners.data[i].name, sizeof metadata.owners.data[i].name);
+                        found = 1;
+                }
+        pthread_mutex_unlock(&metadata.lock);
+        return found;
+}
+
+/* Look up the name of uid, that can take a while with remote user
+ * databases */
+void
+owner_resolve(unsigned uid)
+{
+        struct owner o = { .uid = uid };
+        struct passwd pw, *res;
+        char buf[1024];
+
+        if (owner_name(uid, o.name)) return;
+        if (getpwuid_r(uid, &pw, buf, sizeof buf, &res) || !res)
+                snprintf(o.name, sizeof o.name, "%u", uid);
+        else
+                snprintf(o.name, sizeof o.name, "%s", pw.pw_name);
+        pthread_mutex_lock(&metadata.lock);
+        da_append(&metadata.owners, o);
+        pthread_mutex_unlock(&metadata.lock);
+}
+
+void
+meta_task(void *arg)
+{
+        static __thread uring_op_da ops = { 0 };
+        struct meta_batch *b = arg;
+        struct meta_request *r;
+        int i;
+
+        ops.size = 0;
+        for (i = 0; i < b->requests.size; i++) {
+                r = &b->requests.data[i];
+                da_append(&ops, ((struct uring_op) {
+                                        .opcode = IORING_OP_STATX,
+                                        .dirfd = AT_FDCWD,
+                                        .path = b->paths.data + r->path,
+                                        /* What the client knows is fine */
+                                        .flags = AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+                                        .stx = &r->stx,
+                                }));
+        }
+        uring_run(ops.data, ops.size);
+        for (i = 0; i < b->requests.size; i++) {
+                r = &b->requests.data[i];
+                r->res = ops.data[i].res;
+                if (!r->res) owner_resolve(r->stx.stx_uid);
+        }
+
+        pthread_mutex_lock(&metadata.lock);
+        da_append(&metadata.done, b);
+        pthread_mutex_unlock(&metadata.lock);
+        if (write(posts.efd, &(uint64_t) { 1 }, sizeof(uint64_t)) < 0)
+                error("Can not wake up main thread");
+}
+
+/* Send the entries queued to the pool */
+void
+meta_submit()
+{
+        if (!metadata.next) return;
+        metadata.inflight++;
+        pool_submit(&metadata.group, meta_task, metadata.next);
+        metadata.next = NULL;
+}
+
+/* Queue entry e to be read, if it is stale */
+void
+meta_want(int e)
+{
+        struct meta *m = &metas.data[e];
+        struct entry *entry = &entries.data[e];
+        struct meta_batch *b;
+
+        if (m->state != META_STALE) return;
+        if (!metadata.next) {
+                metadata.next = calloc(1, sizeof *metadata.next);
+                assert(metadata.next);
+        }
+        b = metadata.next;
+        m->state = META_PENDING;
+        da_append(&b->requests, ((struct meta_request) { .entry = e, .gen = m->gen, .path = b->paths.size }));
+        sbuf_puts(&b->paths, PATH(entry));
+        sbuf_append(&b->paths, "/", 1);
+        sbuf_append(&b->paths, NAME(entry), entry->namelen + 1);
+        /* Folders sorted queue all their entries */
+        if (b->requests.size >= META_BATCH) meta_submit();
+}
+
+/* Read the metadata of the rows shown from off, ws of them, and then of
+ * the rest of the view while nothing else is being read */
+void
+meta_fetch(int off, int ws)
+{
+        const int *rows;
+        int i, k;
+
+        if (!metadata.columns && sort_order != SORT_SIZE && sort_order != SORT_MTIME) return;
+        if (metadata.columns)
+                for (i = 0; i < ws; i++)
+                        meta_want(view_at(shown_row(off + i)));
+        meta_submit();
+        if (metadata.inflight) return;
+
+        /* A pass over the view is done again if it changed meanwhile */
+        if (metadata.scan >= view.size) {
+                if (metadata.version == view_version) return;
+                metadata.scan = 0;
+                metadata.version = view_version;
+        }
+        rows = view_rows();
+        for (k = 0; k < META_BATCH && metadata.scan < view.size; metadata.scan++)
+                if (metas.data[rows[metadata.scan]].state == META_STALE) {
+                        meta_want(rows[metadata.scan]);
+                        k++;
+                }
+        meta_submit();
+}
+
+/* What m gives to sort by, if the sort order uses it */
+long long
+meta_sort_key(const struct meta *m)
+{
+        if (sort_order != SORT_SIZE && sort_order != SORT_MTIME) return 0;
+        if (!m->known) return LLONG_MIN;
+        return sort_order == SORT_SIZE ? m->size : m->mtime;
+}
+
+/* Merge the metadata read. Folders sorted by entries whose metadata
+ * changed are sorted again. Return if there was any */
+int
+meta_process()
+{
+        static meta_batch_da done = { 0 };
+        static int_da resort = { 0 };
+        struct meta_request *r;
+        struct meta_batch *b;
+        struct view_span span;
+        meta_batch_da tmp;
+        struct meta *m;
+        long long key;
+        int i, j, k, n;
+
+        pthread_mutex_lock(&metadata.lock);
+        tmp = metadata.done;
+        metadata.done = done;
+        done = tmp;
+        pthread_mutex_unlock(&metadata.lock);
+
+        for (i = 0; i < done.size; i++) {
+                b = done.data[i];
+                for (k = 0; k < b->requests.size; k++) {
+                        r = &b->requests.data[k];
+                        m = &metas.data[r->entry];
+                        /* The entry is gone, and its id could be reused */
+                        if (m->gen != r->gen) continue;
+                        /* Else it changed while being read: it is read again */
+                        if (m->state == META_PENDING) m->state = META_FRESH;
+                        key = meta_sort_key(m);
+                        if ((m->known = !r->res)) {
+                                m->size = r->stx.stx_size;
+                                m->mtime = r->stx.stx_mtime.tv_sec * 1000000000LL + r->stx.stx_mtime.tv_nsec;
+                                m->mode = r->stx.stx_mode;
+                                m->uid = r->stx.stx_uid;
+                        }
+                        /* Its folder was sorted without it */
+                        if (key == meta_sort_key(m)) continue;
+                        n = entries.data[r->entry].parent;
+                        for (j = 0; j < resort.size && resort.data[j] != n; j++)
+                                ;
+                        if (j == resort.size) da_append(&resort, n);
+                }
+                metadata.inflight--;
+                free(b->requests.data);
+                free(b->paths.data);
+                free(b);
+        }
+        k = done.size;
+        done.size = 0;
+
+        for (i = 0; i < resort.size; i++) {
+                if (!nodes.data[n = resort.data[i]].path) continue;
+                span = view_span(n);
+                sort_node(n);
+                view_update_node(n, &span);
+        }
+        resort.size = 0;
+        return k;
+}
+
+/* Read the metadata of every entry again */
+void
+meta_refresh()
+{
+        int i;
+        for (i = 0; i < metas.size; i++)
+                if (metas.data[i].state == META_FRESH) metas.data[i].state = META_STALE;
+}
+
+void
+human_size(char *buf, int size, long long n)
+{
+        const char *units = "BKMGTPE";
+        double v = n;
+        int u = 0;
+
+        while (v >= 1024 && units[u + 1]) {
+                v /= 1024;
+                u++;
+        }
+        if (!u)
+                snprintf(buf, size, "%lld%c", n, units[u]);
+        else if (v < 10)
+                snprintf(buf, size, "%.1f%c", v, units[u]);
+        else
+                snprintf(buf, size, "%.0f%c", v, units[u]);
+}
+
+/* Append the metadata columns of entry e to sb, blank if not read yet */
+void
+meta_print(struct sbuf *sb, int e)
+{
+        static const char types[] = "?pc?d?b?-?l?s???";
+        struct meta *m = &metas.data[e];
+        char mode[11], size[16], date[32], owner[32];
+        struct tm tm;
+        time_t t;
+        int i;
+
+        if (!m->known) {
+                sbuf_printf(sb, "%*s", META_WIDTH, "");
+                return;
+        }
+        mode[0] = types[(m->mode & S_IFMT) >> 12];
+        for (i = 0; i < 9; i++)
+                mode[i + 1] = m->mode & (0400 >> i) ? "rwxrwxrwx"[i] : '-';
+        if (m->mode & S_ISUID) mode[3] = m->mode & S_IXUSR ? 's' : 'S';
+        if (m->mode & S_ISGID) mode[6] = m->mode & S_IXGRP ? 's' : 'S';
+        if (m->mode & S_ISVTX) mode[9] = m->mode & S_IXOTH ? 't' : 'T';
+        mode[10] = 0;
+
+        human_size(size, sizeof size, m->size);
+        t = m->mtime / 1000000000;
+        localtime_r(&t, &tm);
+        /* Like ls: the year for files older than six months */
+        strftime(date, sizeof date, time(NULL) - t < 182 * 24 * 3600 ? "%b %e %H:%M" : "%b %e  %Y", &tm);
+        if (!owner_name(m->uid, owner)) snprintf(owner, sizeof owner, "%u", m->uid);
+        sbuf_printf(sb, "%s %-8.8s %5s %s ", mode, owner, size, date);
+}
+
+/* Folder sizes, like du: the bytes used by a folder and everything under it
+ * in the same filesystem, with files of several links counted once. Folders
+ * are read in parallel by the pool, and what each one holds is cached by
+ * inode and mtime, so only folders changed since are read again. */
+#define INODE_SET_MIN 64
+
+struct inode_key {
+        dev_t dev;
+        ino_t ino;
+};
+
+/* Set of inodes, with open addressing. Inode 0 is an empty slot */
+struct inode_set {
+        struct inode_key *keys;
+        size_t size;
+        size_t cap;
+};
+
+size_t
+inode_hash(dev_t dev, ino_t ino)
+{
+        uint64_t h = (uint64_t) ino * 0x9e3779b97f4a7c15ULL ^ (uint64_t) dev;
+        return h ^ h >> 29;
+}
+
+/* Add (dev, ino) to s. Return if it was not there */
+int
+inode_set_add(struct inode_set *s, dev_t dev, ino_t ino)
+{
+        struct inode_key *old = s->keys;
+        size_t i, cap = s->cap;
+
+        if ((s->size + 1) * 2 > s->cap) {
+                s->cap = s->cap ? s->cap * 2 : INODE_SET_MIN;
+                s->keys = calloc(s->cap, sizeof *s->keys);
+                assert(s->keys);
+                s->size = 0;
+                for (i = 0; i < cap; i++)
+                        if (old[i].ino) inode_set_add(s, old[i].dev, old[i].ino);
+                free(old);
+        }
+        for (i = inode_hash(dev, ino) & (s->cap - 1); s->keys[i].ino; i = (i + 1) & (s->cap - 1))
+                if (s->keys[i].ino == ino && s->keys[i].dev == dev) return 0;
+        s->keys[i] = (struct inode_key) { dev, ino };
+        s->size++;
+        return 1;
+}
+
+/* File with several links, counted once by every computation */
+struct link_size {
+        ino_t ino;
+        long long bytes;
+};
+
+typedef DA(struct link_size) link_size_da;
+
+/* What a folder holds, as read at mtime */
+struct dir_size {
+        dev_t dev;
+        ino_t ino;
+        long long mtime;     /* ns. -1 if it has to be read again */
+        long long own;       /* Bytes of the folder and its files of a link */
+        struct sbuf subdirs; /* Names of its subfolders, each ended by a 0 */
+        link_size_da links;
+};
+
+/* Size of a folder being computed */
+struct tree_req {
+        int entry;
+        unsigned gen;
+        dev_t dev;       /* Filesystem of the folder, the only one counted */
+        long long bytes; /* Counted so far */
+        int pending;     /* Folders queued or being read */
+        int cancel;
+        pthread_mutex_t lock;
+        struct inode_set seen; /* Folders and files of several links counted */
+};
+
+typedef DA(struct tree_req *) tree_req_da;
+
+struct tree_work {
+        struct tree_req *req;
+        char *path; /* Absolute, as the working directory can change */
+        int root;
+};
+
+struct {
+        int automatic; /* Compute the folders shown without asking */
+        pthread_mutex_t lock;
+        struct dir_size *cache; /* Open addressing, by (dev, ino) */
+        size_t cached;
+        size_t cap;
+        long long bytes; /* Taken by the cache */
+        tree_req_da done; /* Finished, to be merged by the main thread */
+        tree_req_da active;
+        struct task_group group;
+} trees = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* Slot of folder (dev, ino) in the cache, empty if it is not there. With
+ * trees.lock held */
+struct dir_size *
+tree_cache_slot(dev_t dev, ino_t ino)
+{
+        struct dir_size *s;
+        size_t i;
+
+        for (i = inode_hash(dev, ino) & (trees.cap - 1);; i = (i + 1) & (trees.cap - 1)) {
+                s = &trees.cache[i];
+                if (!s->ino || (s->ino == ino && s->dev == dev)) return s;
+        }
+}
+
+/* Copy what folder (dev, ino) held at mtime to d. Return if it was cached */
+int
+tree_cache_get(dev_t dev, ino_t ino, long long mtime, struct dir_size *d)
+{
+        struct dir_size *s;
+        int i, found = 0;
+
+        pthread_mutex_lock(&trees.lock);
+        if (trees.cap && (s = tree_cache_slot(dev, ino))->ino && s->mtime == mtime) {
+                d->dev = dev;
+                d->ino = ino;
+                d->mtime = mtime;
+                d->own = s->own;
+                d->subdirs.size = 0;
+                if (s->subdirs.size) sbuf_append(&d->subdirs, s->subdirs.data, s->subdirs.size);
+                d->links.size = 0;
+                for (i = 0; i < s->links.size; i++)
+                        da_append(&d->links, s->links.data[i]);
+                found = 1;
+        }
+        pthread_mutex_unlock(&trees.lock);
+        return found;
+}
+
+void
+tree_cache_put(struct dir_size *d)
+{
+        struct dir_size *old = trees.cache, *s;
+        size_t i, cap;
+
+        pthread_mutex_lock(&trees.lock);
+        if ((trees.cached + 1) * 2 > trees.cap) {
+                cap = trees.cap;
+                trees.cap = cap ? cap * 2 : INODE_SET_MIN;
+                trees.cache = calloc(trees.cap, sizeof *trees.cache);
+                assert(trees.cache);
+                trees.bytes += (long long) (trees.cap - cap) * sizeof *trees.cache;
+                for (i = 0; i < cap; i++)
+                        if (old[i].ino) *tree_cache_slot(old[i].dev, old[i].ino) = old[i];
+                free(old);
+        }
+        s = tree_cache_slot(d->dev, d->ino);
+        if (!s->ino) {
+                s->dev = d->dev;
+                s->ino = d->ino;
+                trees.cached++;
+        }
+        s->mtime = d->mtime;
+        s->own = d->own;
+        trees.bytes -= s->subdirs.capacity + (long long) s->links.capacity * sizeof *s->links.data;
+        s->subdirs.size = 0;
+        if (d->subdirs.size) sbuf_append(&s->subdirs, d->subdirs.data, d->subdirs.size);
+        s->links.size = 0;
+        for (i = 0; i < d->links.size; i++)
+                da_append(&s->links, d->links.data[i]);
+        trees.bytes += s->subdirs.capacity + (long long) s->links.capacity * sizeof *s->links.data;
+        pthread_mutex_unlock(&trees.lock);
+}
+
+/* Forget every folder cached. Sizes computed later read them again */
+void
+tree_cache_clear()
+{
+        size_t i;
+
+        pthread_mutex_lock(&trees.lock);
+        for (i = 0; i < trees.cap; i++) {
+                free(trees.cache[i].subdirs.data);
+                free(trees.cache[i].links.data);
+        }
+        free(trees.cache);
+        trees.cache = NULL;
+        trees.cached = trees.cap = 0;
+        trees.bytes = 0;
+        pthread_mutex_unlock(&trees.lock);
+}
+
+/* Read folder fd again when it is next counted. Its files can change
+ * without changing its mtime */
+void
+tree_cache_drop(int fd)
+{
+        struct stat st;
+        struct dir_size *s;
+
+        if (fstat(fd, &st)) return;
+        pthread_mutex_lock(&trees.lock);
+        if (trees.cap && (s = tree_cache_slot(st.st_dev, st.st_ino))->ino) s->mtime = -1;
+        pthread_mutex_unlock(&trees.lock);
+}
+
+/* Read what folder fd holds to d */
+void
+tree_read(int fd, struct stat *st, struct dir_size *d, const char *path)
+{
+        static __thread char *buf = NULL;
+        static __thread struct sbuf names = { 0 };
+        static __thread uring_op_da ops = { 0 };
+        static __thread struct statx *stx = NULL;
+        static __thread int stx_cap = 0;
+        struct dirent64 *entry;
+        ssize_t nread, off;
+        char *name;
+        int i, n = 0;
+
+        if (!buf) {
+                buf = malloc(GETDENTS_BUF_SIZE);
+                assert(buf);
+        }
+        d->dev = st->st_dev;
+        d->ino = st->st_ino;
+        d->mtime = st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+        d->own = st->st_blocks * 512LL;
+        d->subdirs.size = 0;
+        d->links.size = 0;
+        names.size = 0;
+
+        while ((nread = getdents64(fd, buf, GETDENTS_BUF_SIZE)) > 0) {
+                for (off = 0; off < nread; off += entry->d_reclen) {
+                        entry = (struct dirent64 *) (buf + off);
+                        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) continue;
+                        if (entry->d_type == DT_DIR) {
+                                sbuf_append(&d->subdirs, entry->d_name, strlen(entry->d_name) + 1);
+                        } else {
+                                sbuf_append(&names, entry->d_name, strlen(entry->d_name) + 1);
+                                n++;
+                        }
+                }
+        }
+        if (nread < 0) warn("Can not read dir: %s", path);
+
+        /* The rest are stated together */
+        if (n > stx_cap) {
+                stx_cap = n;
+                stx = realloc(stx, stx_cap * sizeof *stx);
+                assert(stx);
+        }
+        ops.size = 0;
+        for (i = 0, name = names.data; i < n; i++, name += strlen(name) + 1)
+                da_append(&ops, ((struct uring_op) {
+                                        .opcode = IORING_OP_STATX,
+                                        .dirfd = fd,
+                                        .path = name,
+                                        .flags = AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+                                        .stx = &stx[i],
+                                }));
+        uring_run(ops.data, ops.size);
+        for (i = 0; i < n; i++) {
+                if (ops.data[i].res) continue; /* Gone meanwhile */
+                if (S_ISDIR(stx[i].stx_mode)) /* d_type not filled */
+                        sbuf_append(&d->subdirs, ops.data[i].path, strlen(ops.data[i].path) + 1);
+                else if (stx[i].stx_nlink > 1)
+                        da_append(&d->links, ((struct link_size) { stx[i].stx_ino, stx[i].stx_blocks * 512LL }));
+                else
+                        d->own += stx[i].stx_blocks * 512LL;
+        }
+}
+
+void
+tree_post(struct tree_req *req)
+{
+        int wake;
+
+        pthread_mutex_lock(&trees.lock);
+        wake = trees.done.size == 0;
+        da_append(&trees.done, req);
+        pthread_mutex_unlock(&trees.lock);
+        if (wake && write(posts.efd, &(uint64_t) { 1 }, sizeof(uint64_t)) < 0)
+                error("Can not wake up main thread");
+}
+
+void tree_task(void *arg);
+
+void
+tree_queue(struct tree_req *req, char *path, int root)
+{
+        struct tree_work *w = malloc(sizeof *w);
+
+        assert(w);
+        *w = (struct tree_work) { .req = req, .path = path, .root = root };
+        __atomic_add_fetch(&req->pending, 1, __ATOMIC_ACQ_REL);
+        pool_submit(&trees.group, tree_task, w);
+}
+
+/* Count a folder, and queue its subfolders */
+void
+tree_task(void *arg)
+{
+        static __thread struct dir_size d = { 0 };
+        struct tree_work *w = arg;
+        struct tree_req *req = w->req;
+        struct stat st;
+        long long bytes;
+        char *name, *sub, *abs;
+        int i, fd = -1, fresh;
+
+        if (__atomic_load_n(&req->cancel, __ATOMIC_ACQUIRE)) goto done;
+        /* Resolved here, as it stats every folder in the path */
+        if (w->root) {
+                if (!(abs = realpath(w->path, NULL))) {
+                        warn("Can not read dir: %s", w->path);
+                        /* No size to show */
+                        __atomic_store_n(&req->cancel, 1, __ATOMIC_RELEASE);
+                        goto done;
+                }
+                free(w->path);
+                w->path = abs;
+        }
+        fd = open(w->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0 || fstat(fd, &st)) {
+                warn("Can not read dir: %s", w->path);
+                goto done;
+        }
+        if (w->root) req->dev = st.st_dev;
+        /* Other filesystems are not counted, and mounts of a folder
+         * inside itself are counted once */
+        if (st.st_dev != req->dev) goto done;
+        pthread_mutex_lock(&req->lock);
+        fresh = inode_set_add(&req->seen, st.st_dev, st.st_ino);
+        pthread_mutex_unlock(&req->lock);
+        if (!fresh) goto done;
+
+        if (!tree_cache_get(st.st_dev, st.st_ino, st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec, &d)) {
+                tree_read(fd, &st, &d, w->path);
+                tree_cache_put(&d);
+        }
+        bytes = d.own;
+        if (d.links.size) {
+                pthread_mutex_lock(&req->lock);
+                for (i = 0; i < d.links.size; i++)
+                        if (inode_set_add(&req->seen, d.dev, d.links.data[i].ino))
+                                bytes += d.links.data[i].bytes;
+                pthread_mutex_unlock(&req->lock);
+        }
+        __atomic_add_fetch(&req->bytes, bytes, __ATOMIC_RELAXED);
+
+        for (name = d.subdirs.data; name < d.subdirs.data + d.subdirs.size; name += strlen(name) + 1) {
+                sub = strconcat(w->path, "/", name);
+                tree_queue(req, sub, 0);
+        }
+
+done:
+        if (fd >= 0) close(fd);
+        free(w->path);
+        free(w);
+        if (!__atomic_sub_fetch(&req->pending, 1, __ATOMIC_ACQ_REL)) tree_post(req);
+}
+
+char *journal_folder(const char *folder);
+
+/* Compute the size of folder entry e, unless it is already being computed */
+void
+tree_want(int e)
+{
+        struct entry *entry = &entries.data[e];
+        struct tree_req *req;
+        char *path, *abs;
+
+        if (entry->type != DT_DIR || metas.data[e].tree_state == META_PENDING) return;
+        /* From /, as the working directory can change before it is read */
+        path = strconcat(PATH(entry), "/", NAME(entry));
+        abs = journal_folder(path);
+        free(path);
+        req = calloc(1, sizeof *req);
+        assert(req);
+        req->entry = e;
+        req->gen = metas.data[e].gen;
+        pthread_mutex_init(&req->lock, NULL);
+        metas.data[e].tree_state = META_PENDING;
+        da_append(&trees.active, req);
+        tree_queue(req, abs, 1);
+}
+
+/* Compute the folders shown, from off, ws of them, that are outdated and
+ * were computed before, or all of them in automatic mode */
+void
+tree_fetch(int off, int ws)
+{
+        struct meta *m;
+        int i, e;
+
+        for (i = 0; i < ws; i++) {
+                e = view_at(shown_row(off + i));
+                m = &metas.data[e];
+                if (m->tree_state != META_STALE || (!m->tree_known && !trees.automatic)) continue;
+                if (!strcmp(NAME(&entries.data[e]), "..")) continue;
+                tree_want(e);
+        }
+}
+
+void batch_rows(int_da *rows);
+
+/* Compute the size of the marked folders, or the selected one */
+void
+tree_rows()
+{
+        static int_da rows = { 0 };
+        int i;
+
+        batch_rows(&rows);
+        for (i = 0; i < rows.size; i++)
+                tree_want(view_at(rows.data[i]));
+}
+
+/* Merge the sizes computed. Return if there was any */
+int
+tree_process()
+{
+        static tree_req_da done = { 0 };
+        struct tree_req *req;
+        tree_req_da tmp;
+        struct meta *m;
+        int i, k;
+
+        pthread_mutex_lock(&trees.lock);
+        tmp = trees.done;
+        trees.done = done;
+        done = tmp;
+        pthread_mutex_unlock(&trees.lock);
+
+        for (i = 0; i < done.size; i++) {
+                req = done.data[i];
+                for (k = 0; trees.active.data[k] != req; k++)
+                        ;
+                da_remove(&trees.active, k);
+                m = &metas.data[req->entry];
+                if (m->gen == req->gen) {
+                        /* Else it changed meanwhile: it is computed again */
+                        if (m->tree_state == META_PENDING) m->tree_state = META_FRESH;
+                        if (!req->cancel) {
+                                m->tree = req->bytes;
+                                m->tree_known = 1;
+                        }
+                        debug("Size of %s: %lld", NAME(&entries.data[req->entry]), req->bytes);
+                }
+                pthread_mutex_destroy(&req->lock);
+                free(req->seen.keys);
+                free(req);
+        }
+        k = done.size;
+        done.size = 0;
+        return k;
+}
+
+void
+tree_cancel_all()
+{
+        int i;
+        for (i = 0; i < trees.active.size; i++)
+                __atomic_store_n(&trees.active.data[i]->cancel, 1, __ATOMIC_RELEASE);
+}
+
+/* Folder of node n changed: the sizes of the folders holding it are
+ * outdated. If files in it were written, what it holds is read again too */
+void
+tree_changed(int n, int dirfd, int written)
+{
+        int e;
+
+        if (written && dirfd >= 0) tree_cache_drop(dirfd);
+        for (; n != NONE && (e = nodes.data[n].entry) != NONE; n = entries.data[e].parent)
+                if (metas.data[e].tree_state == META_FRESH) metas.data[e].tree_state = META_STALE;
+}
+
+/* Compute again every folder size known, reading every folder again */
+void
+tree_refresh()
+{
+        size_t i;
+        int e;
+
+        pthread_mutex_lock(&trees.lock);
+        for (i = 0; i < trees.cap; i++)
+                trees.cache[i].mtime = -1;
+        pthread_mutex_unlock(&trees.lock);
+        for (e = 0; e < metas.size; e++)
+                if (metas.data[e].tree_state == META_FRESH) metas.data[e].tree_state = META_STALE;
+}
+
+/* Append the size of folder entry e to sb: the bytes counted so far while it
+ * is computed */
+void
+tree_print(struct sbuf *sb, int e)
+{
+        struct meta *m = &metas.data[e];
+        char size[16];
+        int i;
+
+        if (m->tree_state == META_PENDING) {
+                for (i = 0; i < trees.active.size; i++)
+                        if (trees.active.data[i]->entry == e && trees.active.data[i]->gen == m->gen) break;
+                if (i == trees.active.size) return;
+                human_size(size, sizeof size, __atomic_load_n(&trees.active.data[i]->bytes, __ATOMIC_RELAXED));
+                sbuf_printf(sb, " \e[2m%s...\e[0m", size);
+        } else if (m->tree_known) {
+                human_size(size, sizeof size, m->tree);
+                sbuf_printf(sb, " \e[2m%s\e[0m", size);
+        }
+}
+
+/* Bytes taken by the tree, the listing and size caches and the stubs */
+long long
+memory_used()
+{
+        return (long long) (entries.size - free_entries.size) *
+                       (sizeof(struct entry) + sizeof(struct meta) + sizeof(int)) +
+               (long long) (nodes.size - free_nodes.size) * sizeof(struct node) +
+               (long long) (stubs.size - free_stubs.size) * sizeof(struct stub) +
+               memory.names + dircache.bytes + __atomic_load_n(&trees.bytes, __ATOMIC_RELAXED);
+}
+
+int
+stub_child_cmp(const void *_a, const void *_b, void *_names)
+{
+        const struct stub_child *a = _a;
+        const struct stub_child *b = _b;
+        const char *names = _names;
+        return strcmp(names + a->name, names + b->name);
+}
+
+/* Stub of node n, with the ones of its children expanded or evicted */
+int
+stub_new(int n)
+{
+        struct node *node = &nodes.data[n];
+        struct stub_child c;
+        struct entry *entry;
+        int i, s;
+
+        if (free_stubs.size) {
+                s = free_stubs.data[--free_stubs.size];
+        } else {
+                da_append(&stubs, (struct stub) { 0 });
+                s = stubs.size - 1;
+        }
+        stubs.data[s] = (struct stub) { .dev = node->dev, .ino = node->ino, .mtime = node->mtime };
+        for (i = 0; i < node->children.size; i++) {
+                entry = &entries.data[node->children.data[i]];
+                if (entry->node != NONE) {
+                        c.stub = stub_new(entry->node);
+                } else if (entry->stub != NONE) {
+                        c.stub = entry->stub;
+                        entry->stub = NONE;
+                } else {
+                        continue;
+                }
+                c.name = stubs.data[s].names.size;
+                sbuf_append(&stubs.data[s].names, NAME(entry), entry->namelen + 1);
+                da_append(&stubs.data[s].children, c);
+        }
+        if (stubs.data[s].children.size)
+                qsort_r(stubs.data[s].children.data, stubs.data[s].children.size, sizeof c,
+                        stub_child_cmp, stubs.data[s].names.data);
+        return s;
+}
+
+/* Node n was read again from its stub: the folders that were expanded in
+ * it get their stubs, if it is still the same folder */
+void
+stub_expand(int n)
+{
+        struct node *node = &nodes.data[n];
+        struct stub *s;
+        struct entry *entry;
+        int i, c, lo, hi, mid, id = node->stub;
+
+        if (id == NONE) return;
+        node->stub = NONE;
+        s = &stubs.data[id];
+        if (node->dev != s->dev || node->ino != s->ino) {
+                debug("%s is not the folder evicted anymore", node->path);
+                stub_free(id);
+                return;
+        }
+        if (node->mtime != s->mtime) debug("%s changed since it was evicted", node->path);
+        for (i = 0; i < node->children.size && s->children.size; i++) {
+                entry = &entries.data[node->children.data[i]];
+                if (entry->type != DT_DIR || entry->node != NONE || entry->stub != NONE) continue;
+                lo = 0;
+                hi = s->children.size;
+                while (lo < hi) {
+                        mid = (lo + hi) / 2;
+                        if ((c = strcmp(s->names.data + s->children.data[mid].name, NAME(entry))) < 0)
+                                lo = mid + 1;
+                        else
+                                hi = mid;
+                }
+                if (lo == s->children.size || strcmp(s->names.data + s->children.data[lo].name, NAME(entry)))
+                        continue;
+                entry->stub = s->children.data[lo].stub;
+                s->children.data[lo].stub = NONE;
+        }
+        stub_free(id);
+}
+
+/* Expanded folders under node n, whose children start at row start, with
+ * all their rows out of [lo, hi): the highest ones, and how far they are */
+struct evict_candidate {
+        int node;
+        int distance;
+};
+
+typedef DA(struct evict_candidate) evict_da;
+
+void
+evict_collect(int n, int start, int lo, int hi, evict_da *out)
+{
+        struct node *node = &nodes.data[n];
+        int i, sub, row, rows;
+
+        node_sums(node);
+        for (i = 0; i < node->open.size; i++) {
+                row = start + node->open.data[i] + node->before.data[i] + 1;
+                sub = entries.data[node->children.data[node->open.data[i]]].node;
+                rows = nodes.data[sub].rows;
+                if (row >= hi)
+                        da_append(out, ((struct evict_candidate) { sub, row - hi }));
+                else if (row + rows <= lo)
+                        da_append(out, ((struct evict_candidate) { sub, lo - row - rows }));
+                else
+                        evict_collect(sub, row, lo, hi, out);
+        }
+}
+
+int
+evict_cmp(const void *_a, const void *_b)
+{
+        const struct evict_candidate *a = _a;
+        const struct evict_candidate *b = _b;
+        return b->distance - a->distance;
+}
+
+/* Whether node n can be evicted: no folder under it is being read or holds
+ * marked entries */
+int
+node_evictable(int n)
+{
+        struct node *node = &nodes.data[n];
+        int i, e;
+
+        if (node->listing || node->stub != NONE) return 0;
+        if (marked_count)
+                for (i = 0; i < node->children.size; i++)
+                        if (entries.data[node->children.data[i]].marked) return 0;
+        for (i = 0; i < node->open.size; i++) {
+                e = node->children.data[node->open.data[i]];
+                if (!node_evictable(entries.data[e].node)) return 0;
+        }
+        return 1;
+}
+
+/* Collapse node n to a stub, out of the listing cache too */
+void
+node_evict(int n)
+{
+        int e = nodes.data[n].entry;
+        int start = node_row(n), rows = nodes.data[n].rows;
+        int s = stub_new(n);
+
+        debug("Evicting %s: %d rows", nodes.data[n].path, rows);
+        memory.evicting = 1;
+        node_free(n);
+        memory.evicting = 0;
+        entries.data[e].stub = s;
+        if (selected_row >= start + rows) selected_row -= rows;
+        if (woffset >= start + rows) woffset -= rows;
+}
+
+/* Keep under the memory budget, before drawing: the listing cache and the
+ * size cache are dropped first, then the folders expanded farthest from the
+ * window are evicted. If that is not enough, reading folders is stopped.
+ * Evicted folders coming back near the window are expanded again. */
+void
+memory_check()
+{
+        static evict_da candidates = { 0 };
+        static unsigned tried = 0; /* view_version nothing could be evicted at */
+        int nrows = wsize.ws_row > 1 ? wsize.ws_row - 1 : 0;
+        int i, r, e, root, start, lo, hi;
+
+        if (filter.active) return;
+        /* The window as it is going to be drawn, with the selection */
+        if (selected_row < woffset) woffset = selected_row;
+        if (selected_row >= woffset + nrows) woffset = selected_row - nrows + 1;
+        lo = woffset - nrows;
+        hi = woffset + 2 * nrows;
+        if (lo < 0) lo = 0;
+        if (hi > view.size) hi = view.size;
+
+        if (stubs.size > free_stubs.size)
+                for (r = lo; r < hi && r < view.size; r++) {
+                        e = view_at(r);
+                        if (entries.data[e].stub != NONE && entries.data[e].node == NONE) add_subfolder(r, 1);
+                }
+
+        if (!memory.budget || memory_used() <= memory.budget) {
+                memory.warned = 0;
+                return;
+        }
+        while (dircache.listings.size && memory_used() > memory.budget)
+                dircache_forget(0);
+        if (memory_used() > memory.budget && __atomic_load_n(&trees.bytes, __ATOMIC_RELAXED)) {
+                debug("Forgetting the size cache");
+                tree_cache_clear();
+        }
+        if (memory_used() <= memory.budget || tried == view_version) return;
+
+        candidates.size = 0;
+        for (root = start = 0; root < roots.size; start += nodes.data[roots.data[root++]].rows)
+                evict_collect(roots.data[root], start, lo, hi, &candidates);
+        qsort(candidates.data, candidates.size, sizeof *candidates.data, evict_cmp);
+        for (i = 0; i < candidates.size && memory_used() > memory.budget; i++)
+                if (node_evictable(candidates.data[i].node)) node_evict(candidates.data[i].node);
+        if (memory_used() <= memory.budget) return;
+
+        tried = view_version;
+        if (!memory.warned) warn(loads.size ? "Memory budget reached: reading folders stopped" : "Memory budget reached");
+        memory.warned = 1;
+        load_cancel_all();
+}
+
+/* Append the memory taken, and the budget, to sb */
+void
+memory_status(struct sbuf *sb)
+{
+        char used[16], budget[16];
+
+        human_size(used, sizeof used, memory_used());
+        if (!memory.budget) {
+                sbuf_printf(sb, " \e[2m%s\e[0m", used);
+                return;
+        }
+        human_size(budget, sizeof budget, memory.budget);
+        sbuf_printf(sb, " %s%s/%s\e[0m", memory.warned ? "\e[31m" : "\e[2m", used, budget);
+}
+
+/* Append the counters to sb: runs, mean and max ms */
+void
+perf_status(struct sbuf *sb)
+{
+        struct perf_counter *c;
+        int k;
+
+        for (k = 0; k < PERF_COUNT; k++) {
+                c = &perf.c[k];
+                if (c->count)
+                        sbuf_printf(sb, " %s %lld:%.1f/%.1fms", PERF_NAMES[k], c->count,
+                                    c->ns / 1e6 / c->count, c->max_ns / 1e6);
+        }
+}
+
+/* Print the counters to stderr, as stdout is read by the shell */
+void
+perf_dump()
+{
+        struct perf_counter *c;
+        int k;
+
+        fprintf(stderr, "%-8s %8s %12s %10s %10s %12s %14s %10s\n", "",
+                "runs", "total ms", "mean ms", "max ms", "entries", "bytes", "syscalls");
+        for (k = 0; k < PERF_COUNT; k++) {
+                c = &perf.c[k];
+                if (!c->count) continue;
+                fprintf(stderr, "%-8s %8lld %12.2f %10.3f %10.3f %12lld %14lld %10lld\n", PERF_NAMES[k],
+                        c->count, c->ns / 1e6, c->ns / 1e6 / c->count, c->max_ns / 1e6,
+                        c->entries, c->bytes, c->syscalls);
+        }
+}
+
+void job_status(struct sbuf *sb);
+
+/* Render the visible window and the status line into the back buffer and
+ * send only the rows that differ from the last frame, all in a single
+ * write. */
+void
+refresh()
+{
+        static struct sbuf row = { 0 };
+        long long start = perf_start();
+        struct sbuf tmp;
+        int i, r, e;
+        int full;
+        int nrows = wsize.ws_row > 1 ? wsize.ws_row - 1 : 0;
+        int count = shown_count();
+        int sel = cursor_pos();
+        int *off = filter.active ? &filter.woffset : &woffset;
+        /* I don't know how this work, just assume calcs are right */
+        int ws = (nrows < count) ? nrows : count;
+
+        if (sel < *off) *off = sel;
+        if (sel >= *off + ws) *off = sel - ws + 1;
+        if (*off > count - ws) *off = count - ws;
+        meta_fetch(*off, ws);
+        tree_fetch(*off, ws);
+
+        if (frame.ws_row != wsize.ws_row || frame.ws_col != wsize.ws_col) {
+                /* There is a row per terminal line, and at least one */
+                full = frame.rows ? (frame.ws_row > 1 ? frame.ws_row : 1) : 0;
+                for (i = nrows + 1; i < full; i++)
+                        free(frame.rows[i].data);
+                frame.rows = realloc(frame.rows, (nrows + 1) * sizeof *frame.rows);
+                assert(frame.rows);
+                for (i = full; i <= nrows; i++)
+                        frame.rows[i] = (struct sbuf) { 0 };
+                frame.ws_row = wsize.ws_row;
+                frame.ws_col = wsize.ws_col;
+                frame.valid = 0;
+        }
+
+        full = !frame.valid;
+        if (full) sbuf_puts(&outbuf, "\e[2J");
+
+        /* Rows [0, nrows) are the list, row nrows is the status line */
+        for (i = 0; i <= nrows && i < wsize.ws_row; i++) {
+                row.size = 0;
+                if (i == nrows) {
+                        if (prompt.active) {
+                                sbuf_puts(&row, prompt.label);
+                                sbuf_append(&row, prompt.text, prompt.len);
+                        } else if (filter.active) {
+                                sbuf_printf(&row, "%s: %s [%d/%d]",
+                                            filter.fuzzy ? "fuzzy filter" : "filter",
+                                            filter.query, count, view.size);
+                        } else if (finder.compiled) {
+                                sbuf_printf(&row, "%c%s", finder.global ? '?' : '/', finder.pattern);
+                                search_count(&row);
+                        }
+                        if (!prompt.active && marked_count) sbuf_printf(&row, " %d marked", marked_count);
+                        if (!prompt.active) job_status(&row);
+                        if (!prompt.active) memory_status(&row);
+                        if (!prompt.active && perf.overlay) perf_status(&row);
+                } else if (i < ws) {
+                        r = shown_row(*off + i);
+                        if (r == selected_row)
+                                sbuf_append(&row, "\e[7m", 4);
+                        e = view_at(r);
+                        if (entries.data[e].marked) sbuf_append(&row, "* ", 2);
+                        if (metadata.columns) meta_print(&row, e);
+                        print_row(&row, e);
+                        tree_print(&row, e);
+                }
+                row_fit(&row, wsize.ws_col);
+                if (!full && row.size == frame.rows[i].size &&
+                    (!row.size || !memcmp(row.data, frame.rows[i].data, row.size)))
+                        continue;
+                sbuf_printf(&outbuf, "\e[%d;1H", i + 1);
+                /* Rows past the entries are empty, and may not be allocated */
+                if (row.size) sbuf_append(&outbuf, row.data, row.size);
+                sbuf_append(&outbuf, "\e[K", 3);
+                /* Keep what was sent as the new back buffer row */
+                tmp = frame.rows[i];
+                frame.rows[i] = row;
+                row = tmp;
+        }
+
+        /* The cursor is only shown while editing the prompt */
+        if (prompt.active)
+                sbuf_printf(&outbuf, "\e[%d;%dH\e[?25h", nrows + 1,
+                            (int) strlen(prompt.label) + prompt.len + 1);
+        else if (frame.cursor || full)
+                sbuf_puts(&outbuf, "\e[?25l");
+        frame.cursor = prompt.active;
+        frame.valid = 1;
+        out_flush();
+        perf_end(PERF_REFRESH, start, ws);
+}
+
+int
+is_folder(struct entry *entry)
+{
+        switch (entry->type) {
+        case DT_DIR:
+                return 1;
+        case DT_LNK:
+                /* Todo: accept symlinks */
+        default:
+                return 0;
+        }
+}
+
+void
+place_cursor_midwindow()
+{
+        selected_row = view.size / 2;
+        woffset = (wsize.ws_row >= view.size) ?
+                  0 :
+                  selected_row - wsize.ws_row / 2;
+}
+
+void journal_chdir(const char *folder);
+
+void
+change_dir()
+{
+        static struct sbuf buf = { 0 };
+        const char *name;
+        int i, fd;
+
+        if (!is_folder(&ROW(selected_row))) {
+                warn("Can not change dir to %s: it is not a folder",
+                       entry_path(&buf, &ROW(selected_row)));
+                return;
+        }
+
+        fd = entry_at(&ROW(selected_row), &buf, &name);
+        if ((fd = openat(fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0 ||
+            fchdir(fd)) {
+                error("Can not change dir to %s", name);
+                if (fd >= 0) close(fd);
+                return;
+        }
+        close(fd);
+        journal_chdir(entry_path(&buf, &ROW(selected_row)));
+
+        for (i = 0; i < roots.size; i++)
+                node_free(roots.data[i]);
+        roots.size = 0;
+        selected_row = woffset = 0;
+        cursor_pending = 1;
+        index_start();
+        finder.hits_valid = 0;
+        add_root(".", 1);
+}
+
+/* TODO: this is ugly as fuck. Noodle code :) */
+int
+create_filename_path_if_not_exists(const char *path)
+{
+        char *full_path = strdup(path);
+        char *current_path = full_path;
+        char *curr_dir = full_path;
+        struct stat buf;
+
+        while ((current_path = strchr(current_path, '/'))) {
+                *current_path = 0;
+                if (stat(full_path, &buf) != -1)
+                        ; // check if dir exists
+                else if (*full_path == 0)
+                        ; // check if full path is not empty
+                else if (!strcmp(".", curr_dir))
+                        ; // check if curr_dir is not '.'
+                else if (mkdir(full_path, 0700)) {
+                        error("Can't mkdir `%s`", full_path);
+                        free(full_path);
+                        return -1;
+                }
+                /* Restore '/' and point to the first char after the '/' */
+                *(current_path++) = '/';
+                curr_dir = current_path;
+        }
+
+        free(full_path);
+        return 0;
+}
+
+/* Trash. Deleted entries are moved to a trash folder in their filesystem,
+ * so deleting and undoing are a rename whatever their size. Filesystems
+ * where it can not be created use the trash in HOME, and entries are
+ * copied there (cloned if the filesystem can). */
+#define TRASH_DIR ".local/share/fl/trash" /* Start at HOME */
+
+struct trash {
+        dev_t dev;
+        char *path;
+};
+
+typedef DA(struct trash) trash_da;
+
+trash_da trashes = { 0 };
+
+/* Trash folder in HOME, or NULL */
+const char *
+home_trash()
+{
+        static char *path = NULL;
+        struct stat st;
+        char *home, *p;
+
+        if (path) return path;
+        if (!(home = getenv("HOME"))) {
+                report("Can not get env `HOME`");
+                return NULL;
+        }
+        p = strconcat(home, "/" TRASH_DIR "/");
+        if (create_filename_path_if_not_exists(p) || stat(p, &st)) {
+                error("Can not create trash `%s`", p);
+                free(p);
+                return NULL;
+        }
+        p[strlen(p) - 1] = 0;
+        path = p;
+        da_append(&trashes, ((struct trash) { st.st_dev, strdup(path) }));
+        return path;
+}
+
+/* Trash folder for entries of folder, in filesystem dev. It is created at
+ * the top of the filesystem, as .fl-trash-UID */
+const char *
+trash_find(const char *folder, dev_t dev)
+{
+        char top[PATH_MAX], parent[PATH_MAX + 32];
+        char *path, *slash;
+        struct stat st;
+        int i;
+
+        if (!home_trash()) return NULL;
+        for (i = 0; i < trashes.size; i++)
+                if (trashes.data[i].dev == dev) return trashes.data[i].path;
+
+        /* Go up while the parent is in the same filesystem */
+        if (!realpath(folder, top)) return home_trash();
+        while (strcmp(top, "/")) {
+                snprintf(parent, sizeof parent, "%s/..", top);
+                if (stat(parent, &st) || st.st_dev != dev) break;
+                slash = strrchr(top, '/');
+                slash[slash == top] = 0;
+        }
+
+        snprintf(parent, sizeof parent, "%s/.fl-trash-%d", strcmp(top, "/") ? top : "", (int) getuid());
+        if ((mkdir(parent, 0700) && errno != EEXIST) ||
+            lstat(parent, &st) || !S_ISDIR(st.st_mode) || st.st_uid != getuid() || st.st_dev != dev) {
+                /* Entries of this filesystem are copied to the HOME trash */
+                da_append(&trashes, ((struct trash) { dev, strdup(home_trash()) }));
+                return home_trash();
+        }
+        path = strdup(parent);
+        da_append(&trashes, ((struct trash) { dev, path }));
+        return path;
+}
+
+/* Trash folders are looked up by the job workers */
+const char *
+trash_for(const char *folder, dev_t dev)
+{
+        static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+        const char *path;
+
+        pthread_mutex_lock(&lock);
+        path = trash_find(folder, dev);
+        pthread_mutex_unlock(&lock);
+        return path;
+}
+
+/* Bytes copied per call, so copies can report progress and be canceled */
+#define COPY_CHUNK (8 << 20)
+
+struct job;
+int job_progress(ssize_t n);
+void job_start_copy(long long total);
+
+/* Copy the data of in to out: cloned if the filesystem supports it, else
+ * copied by the kernel */
+int
+copy_data(int in, int out)
+{
+        char buf[64 * 1024];
+        struct stat st;
+        ssize_t n;
+
+        if (!ioctl(out, FICLONE, in))
+                return fstat(in, &st) ? 0 : job_progress(st.st_size);
+        while ((n = copy_file_range(in, NULL, out, NULL, COPY_CHUNK, 0)) > 0)
+                if (job_progress(n)) return -1;
+        if (!n) return 0;
+        if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP)
+                return -1;
+        while ((n = sendfile(out, in, NULL, COPY_CHUNK)) > 0)
+                if (job_progress(n)) return -1;
+        if (!n) return 0;
+        if (errno != EINVAL && errno != ENOSYS) return -1;
+        while ((n = read(in, buf, sizeof buf)) > 0)
+                if (write(out, buf, n) != n || job_progress(n)) return -1;
+        return n;
+}
+
+/* Blob store. Regular files copied to the HOME trash from other
+ * filesystems are kept once per content, in BLOB_DIR, named by a hash of
+ * it read in chunks: the trash item is a hard link to the blob. Copies of
+ * the same content are linked to the blob instead of written again, so a
+ * blob only holds content: the mode, owner and times of the files linked
+ * are kept with their deleted entry, and set on them when restored. Blobs
+ * not linked from the trash anymore are removed by blob_gc(). */
+#define BLOB_DIR ".local/share/fl/blobs" /* Start at HOME */
+#define BLOB_CHUNK (1 << 20)
+#define BLOB_MIN (64 << 10) /* Smaller files are just copied */
+
+/* Metadata of a file linked to a blob. Followed by its path from the trash
+ * item, null terminated ("" for the item itself) */
+struct blob_meta {
+        uint32_t size; /* With the path */
+        uint32_t mode;
+        uint32_t uid;
+        uint32_t gid;
+        int64_t atime;
+        int64_t mtime;
+        uint32_t atime_ns;
+        uint32_t mtime_ns;
+};
+
+/* Set by the threads copying to the trash: metadata of the files linked */
+static __thread struct sbuf *copy_to_blobs = NULL;
+
+/* Path from the item copied by copy_tree() of the entry it is at */
+static __thread struct sbuf copy_path = { 0 };
+
+/* Descriptor of the blob store, or -1 */
+int
+blob_dir()
+{
+        static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+        static int fd = -2;
+        char *home, *path;
+
+        pthread_mutex_lock(&lock);
+        if (fd == -2 && (home = getenv("HOME"))) {
+                path = strconcat(home, "/" BLOB_DIR "/");
+                if (create_filename_path_if_not_exists(path) ||
+                    (fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+                        error("Can not open blob store `%s`", path);
+                        fd = -1;
+                }
+                free(path);
+        }
+        pthread_mutex_unlock(&lock);
+        return fd;
+}
+
+uint64_t
+hash_chunk(const unsigned char *p, size_t n, uint64_t h)
+{
+        uint64_t w;
+
+        for (; n >= 8; p += 8, n -= 8) {
+                memcpy(&w, p, 8);
+                h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+                h ^= h >> 29;
+        }
+        for (; n; n--)
+                h = (h ^ *p++) * 0x100000001b3ULL;
+        return h;
+}
+
+/* Buffers of BLOB_CHUNK bytes for the thread */
+unsigned char *
+blob_buffer(int i)
+{
+        static __thread unsigned char *bufs[2] = { NULL, NULL };
+        if (!bufs[i]) bufs[i] = malloc(BLOB_CHUNK);
+        return bufs[i];
+}
+
+/* Hash of the data of fd, to *h */
+int
+blob_hash(int fd, uint64_t *h)
+{
+        unsigned char *buf = blob_buffer(0);
+        off_t off = 0;
+        ssize_t n;
+
+        if (!buf) return -1;
+        *h = 0xcbf29ce484222325ULL;
+        while ((n = pread(fd, buf, BLOB_CHUNK, off)) > 0) {
+                *h = hash_chunk(buf, n, *h);
+                off += n;
+        }
+        return n;
+}
+
+/* Whether the data of fd and blob name are the same */
+int
+blob_equal(int fd, int bfd, const char *name)
+{
+        unsigned char *a = blob_buffer(0), *b = blob_buffer(1);
+        off_t off = 0;
+        ssize_t n;
+        int in, eq = 1;
+
+        if (!a || !b || (in = openat(bfd, name, O_RDONLY | O_CLOEXEC)) < 0) return 0;
+        while (eq && (n = pread(fd, a, BLOB_CHUNK, off)) > 0) {
+                eq = pread(in, b, n, off) == n && !memcmp(a, b, n);
+                off += n;
+        }
+        close(in);
+        return eq && n == 0;
+}
+
+/* Keep the metadata st of the file linked at copy_path */
+void
+blob_note(const struct stat *st)
+{
+        struct blob_meta m = {
+                .size = sizeof m + copy_path.size + 1,
+                .mode = st->st_mode,
+                .uid = st->st_uid,
+                .gid = st->st_gid,
+                .atime = st->st_atim.tv_sec,
+                .mtime = st->st_mtim.tv_sec,
+                .atime_ns = st->st_atim.tv_nsec,
+                .mtime_ns = st->st_mtim.tv_nsec,
+        };
+
+        sbuf_append(copy_to_blobs, (char *) &m, sizeof m);
+        if (copy_path.size) sbuf_append(copy_to_blobs, copy_path.data, copy_path.size);
+        sbuf_append(copy_to_blobs, "", 1);
+}
+
+/* Whether the n bytes at p are blob_meta with their paths */
+int
+blob_meta_valid(const char *p, int n)
+{
+        struct blob_meta m;
+        int off;
+
+        for (off = 0; off < n; off += m.size) {
+                if (n - off < (int) sizeof m) return 0;
+                memcpy(&m, p + off, sizeof m);
+                if (m.size <= sizeof m || m.size > (unsigned) (n - off) || p[off + m.size - 1]) return 0;
+        }
+        return 1;
+}
+
+/* Set the metadata in meta on the files of the item restored to path.
+ * Return -1 on error */
+int
+blob_restore(const char *path, const struct sbuf *meta)
+{
+        struct timespec times[2];
+        struct blob_meta m;
+        char *filename;
+        int off, ret = 0;
+
+        for (off = 0; off < meta->size; off += m.size) {
+                memcpy(&m, meta->data + off, sizeof m);
+                filename = meta->data[off + sizeof m] ? strconcat(path, "/", meta->data + off + sizeof m) : strdup(path);
+                /* The owner can only be kept by root, so failing is fine */
+                if (fchownat(AT_FDCWD, filename, m.uid, m.gid, AT_SYMLINK_NOFOLLOW))
+                        ;
+                times[0] = (struct timespec) { m.atime, m.atime_ns };
+                times[1] = (struct timespec) { m.mtime, m.mtime_ns };
+                if (fchmodat(AT_FDCWD, filename, m.mode & 07777, 0) ||
+                    utimensat(AT_FDCWD, filename, times, AT_SYMLINK_NOFOLLOW))
+                        ret = -1;
+                free(filename);
+        }
+        return ret;
+}
+
+/* Create dname from dfd as a link to the blob of in, whose stat is st, and
+ * keep st. The blob is created if needed. Return 0 if done, -1 on error, and
+ * 1 if in is not kept in the store */
+int
+blob_store(int in, const struct stat *st, int dfd, const char *dname)
+{
+        static unsigned count = 0;
+        char name[64], tmp[64];
+        struct stat bst;
+        uint64_t h;
+        int out, bfd;
+
+        if (!copy_to_blobs || st->st_size < BLOB_MIN || (bfd = blob_dir()) < 0) return 1;
+        if (blob_hash(in, &h)) return 1;
+        snprintf(name, sizeof name, "%016llx.%llx", (unsigned long long) h, (unsigned long long) st->st_size);
+
+        if (!fstatat(bfd, name, &bst, AT_SYMLINK_NOFOLLOW) && bst.st_size == st->st_size &&
+            blob_equal(in, bfd, name) && !linkat(bfd, name, dfd, dname, 0)) {
+                blob_note(st);
+                return job_progress(st->st_size);
+        }
+
+        /* New content with the same hash: it replaces the blob. Items
+         * linked to the old one keep it */
+        snprintf(tmp, sizeof tmp, "tmp.%d.%u", (int) getpid(), __atomic_fetch_add(&count, 1, __ATOMIC_RELAXED));
+        if ((out = openat(bfd, tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600)) < 0) return 1;
+        if (copy_data(in, out)) {
+                close(out);
+                unlinkat(bfd, tmp, 0);
+                return -1;
+        }
+        if (close(out)) {
+                unlinkat(bfd, tmp, 0);
+                return -1;
+        }
+        if (renameat(bfd, tmp, bfd, name)) {
+                unlinkat(bfd, tmp, 0);
+        } else if (!linkat(bfd, name, dfd, dname, 0)) {
+                blob_note(st);
+                return 0;
+        }
+        /* To be copied again from the start, and counted again */
+        job_progress(-st->st_size);
+        return lseek(in, 0, SEEK_SET) ? -1 : 1;
+}
+
+/* Remove the blobs only the store links to */
+void
+blob_gc()
+{
+        struct dirent *d;
+        struct stat st;
+        DIR *dir;
+        int fd;
+
+        if ((fd = blob_dir()) < 0 || (fd = openat(fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+                return;
+        if (!(dir = fdopendir(fd))) {
+                close(fd);
+                return;
+        }
+        while ((d = readdir(dir)))
+                if (d->d_name[0] != '.' && strncmp(d->d_name, "tmp.", 4) &&
+                    !fstatat(fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) && st.st_nlink == 1)
+                        unlinkat(fd, d->d_name, 0);
+        closedir(dir);
+}
+
+/* Size of the files in sname, reached from sfd */
+long long
+tree_size(int sfd, const char *sname)
+{
+        struct dirent *d;
+        struct stat st;
+        long long size;
+        DIR *dir;
+        int fd;
+
+        if (fstatat(sfd, sname, &st, AT_SYMLINK_NOFOLLOW)) return 0;
+        if (!S_ISDIR(st.st_mode)) return S_ISREG(st.st_mode) ? st.st_size : 0;
+        if ((fd = openat(sfd, sname, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) return 0;
+        if (!(dir = fdopendir(fd))) {
+                close(fd);
+                return 0;
+        }
+        for (size = 0; (d = readdir(dir));)
+                if (strcmp(d->d_name, ".") && strcmp(d->d_name, ".."))
+                        size += tree_size(fd, d->d_name);
+        closedir(dir);
+        return size;
+}
+
+/* Copy sname, reached from sfd, to dname from dfd, with its mode, owner and
+ * times. Folders are copied with everything in them. */
+int
+copy_tree(int sfd, const char *sname, int dfd, const char *dname)
+{
+        struct timespec times[2];
+        struct dirent *d;
+        struct stat st;
+        char link[PATH_MAX];
+        DIR *dir;
+        ssize_t n;
+        int in, out, len, ret = 0;
+
+        if (fstatat(sfd, sname, &st, AT_SYMLINK_NOFOLLOW)) return -1;
+
+        switch (st.st_mode & S_IFMT) {
+        case S_IFREG:
+                if ((in = openat(sfd, sname, O_RDONLY | O_CLOEXEC)) < 0) return -1;
+                /* A blob keeps its own mode, owner and times */
+                if ((ret = blob_store(in, &st, dfd, dname)) <= 0) {
+                        close(in);
+                        return ret;
+                }
+                ret = 0;
+                if ((out = openat(dfd, dname, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600)) < 0) {
+                        close(in);
+                        return -1;
+                }
+                ret = copy_data(in, out);
+                close(in);
+                if (close(out)) ret = -1;
+                break;
+        case S_IFDIR:
+                if (mkdirat(dfd, dname, 0700)) return -1;
+                if ((in = openat(sfd, sname, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) return -1;
+                if ((out = openat(dfd, dname, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0 ||
+                    !(dir = fdopendir(in))) {
+                        close(in);
+                        if (out >= 0) close(out);
+                        return -1;
+                }
+                while (!ret && (d = readdir(dir))) {
+                        if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, "..")) continue;
+                        len = copy_path.size;
+                        if (len) sbuf_append(&copy_path, "/", 1);
+                        sbuf_append(&copy_path, d->d_name, strlen(d->d_name));
+                        ret = copy_tree(in, d->d_name, out, d->d_name);
+                        copy_path.size = len;
+                }
+                closedir(dir);
+                close(out);
+                break;
+        case S_IFLNK:
+                if ((n = readlinkat(sfd, sname, link, sizeof link - 1)) < 0) return -1;
+                link[n] = 0;
+                if (symlinkat(link, dfd, dname)) return -1;
+                break;
+        default:
+                if (mknodat(dfd, dname, st.st_mode, st.st_rdev)) return -1;
+                break;
+        }
+        if (ret) return ret;
+
+        /* The owner can only be kept by root, so failing is fine */
+        if (fchownat(dfd, dname, st.st_uid, st.st_gid, AT_SYMLINK_NOFOLLOW))
+                ;
+        if (!S_ISLNK(st.st_mode) && fchmodat(dfd, dname, st.st_mode & 07777, 0)) return -1;
+        times[0] = st.st_atim;
+        times[1] = st.st_mtim;
+        return utimensat(dfd, dname, times, AT_SYMLINK_NOFOLLOW);
+}
+
+/* Remove name, reached from dfd, and everything in it. The entries of each
+ * folder are removed in a single batch */
+int
+remove_tree(int dfd, const char *name)
+{
+        struct sbuf names = { 0 };
+        uring_op_da ops = { 0 };
+        int_da offsets = { 0 };
+        struct dirent *d;
+        DIR *dir;
+        int i, fd, ret = 0;
+
+        if (!unlinkat(dfd, name, 0)) return 0;
+        if (errno != EISDIR && errno != EPERM) return -1;
+        if ((fd = openat(dfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0)
+                return -1;
+        if (!(dir = fdopendir(fd))) {
+                close(fd);
+                return -1;
+        }
+        while ((d = readdir(dir))) {
+                if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, "..")) continue;
+                da_append(&offsets, names.size);
+                sbuf_append(&names, d->d_name, strlen(d->d_name) + 1);
+        }
+        for (i = 0; i < offsets.size; i++)
+                da_append(&ops, ((struct uring_op) {
+                                        .opcode = IORING_OP_UNLINKAT,
+                                        .dirfd = fd,
+                                        .path = names.data + offsets.data[i],
+                                }));
+        uring_run(ops.data, ops.size);
+        /* Folders are left, to be emptied first */
+        for (i = 0; !ret && i < ops.size; i++) {
+                if (ops.data[i].res == -EISDIR || ops.data[i].res == -EPERM)
+                        ret = remove_tree(fd, ops.data[i].path);
+                else if (ops.data[i].res) {
+                        errno = -ops.data[i].res;
+                        ret = -1;
+                }
+        }
+        closedir(dir);
+        free(names.data);
+        free(offsets.data);
+        free(ops.data);
+        return ret ? ret : unlinkat(dfd, name, AT_REMOVEDIR);
+}
+
+/* Move sname from sfd to dname from dfd, without replacing it. Across
+ * filesystems it is copied and then removed. */
+int
+move_tree(int sfd, const char *sname, int dfd, const char *dname)
+{
+        int err;
+
+        if (!renameat2(sfd, sname, dfd, dname, RENAME_NOREPLACE)) return 0;
+        if (errno != EXDEV) return -1;
+        job_start_copy(tree_size(sfd, sname));
+        /* The source is only removed once it is copied, so a failed or
+         * canceled copy leaves things as they were */
+        if (copy_tree(sfd, sname, dfd, dname)) {
+                err = errno;
+                remove_tree(dfd, dname);
+                errno = err;
+                return -1;
+        }
+        return remove_tree(sfd, sname);
+}
+
+/* Path for a new item in the trash of the filesystem dev, for an entry of
+ * folder. Free it after use. NULL if there is no trash */
+char *
+trash_item(const char *folder, dev_t dev)
+{
+        static unsigned count = 0;
+        const char *trash;
+        char item[64];
+
+        if (!(trash = trash_for(folder, dev))) return NULL;
+        snprintf(item, sizeof item, "%lld.%d.%u", (long long) time(NULL), (int) getpid(),
+                 __atomic_fetch_add(&count, 1, __ATOMIC_RELAXED));
+        return strconcat(trash, "/", item);
+}
+
+/* Undo journal. Deletes are appended to it, and restores and evictions add
+ * a record dropping them, so the undo list is read back at start. It is
+ * rewritten then without the records dropped. */
+#define JOURNAL_FILE ".local/share/fl/journal" /* Start at HOME */
+#define TRASH_SIZE_DEFAULT 1024                /* MiB */
+
+enum {
+        JOURNAL_DELETE,
+        JOURNAL_DROP,
+};
+
+/* Followed by the folder, name and trash path, null terminated, and the
+ * blob_meta of the entry */
+struct journal_record {
+        uint32_t size; /* Of the record with its strings */
+        uint8_t kind;
+        uint8_t type;
+        uint16_t unused;
+        uint32_t batch;
+        uint64_t ino;
+        int64_t bytes;
+};
+
+struct {
+        int fd;
+        int lock;         /* Held shared while fl runs */
+        char *path;
+        char *cwd;        /* Folders are kept from / */
+        long long max;    /* Trash size to keep, bytes */
+        unsigned batch;   /* Last undo batch */
+} journal = {
+        .fd = -1,
+        .lock = -1,
+        .max = (long long) TRASH_SIZE_DEFAULT << 20,
+};
+
+/* Free the strings of deleted entry d */
+void
+deleted_free(struct deleted_entry *d)
+{
+        free(d->path);
+        free(d->name);
+        free(d->trash);
+        free(d->meta.data);
+}
+
+/* Path from / of folder, relative to the working directory */
+char *
+journal_folder(const char *folder)
+{
+        if (folder[0] == '/' || !journal.cwd) return strdup(folder);
+        if (!strcmp(folder, ".")) return strdup(journal.cwd);
+        if (!strncmp(folder, "./", 2)) folder += 2;
+        return strconcat(journal.cwd, "/", folder);
+}
+
+/* Path of folder as the tree lists it, if it is in the working directory */
+char *
+journal_relative(const char *folder)
+{
+        int len;
+
+        if (!journal.cwd) return strdup(folder);
+        len = strlen(journal.cwd);
+        if (!strcmp(folder, journal.cwd)) return strdup(".");
+        if (!strncmp(folder, journal.cwd, len) && folder[len] == '/')
+                return strconcat(".", folder + len);
+        return strdup(folder);
+}
+
+/* The working directory changed to folder, relative to the last one */
+void
+journal_chdir(const char *folder)
+{
+        char cwd[PATH_MAX], *old = journal.cwd;
+
+        journal.cwd = getcwd(cwd, sizeof cwd) ? strdup(cwd) : journal_folder(folder);
+        free(old);
+}
+
+void
+journal_write(struct sbuf *sb, int kind, struct deleted_entry *d)
+{
+        struct journal_record r = {
+                .kind = kind,
+                .type = d->type,
+                .batch = d->batch,
+                .ino = d->ino,
+                .bytes = d->size,
+        };
+        const char *folder = kind == JOURNAL_DELETE ? d->path : "";
+        int start = sb->size;
+
+        sbuf_append(sb, (char *) &r, sizeof r);
+        sbuf_append(sb, folder, strlen(folder) + 1);
+        sbuf_append(sb, kind == JOURNAL_DELETE ? d->name : "", kind == JOURNAL_DELETE ? strlen(d->name) + 1 : 1);
+        sbuf_append(sb, d->trash, strlen(d->trash) + 1);
+        if (kind == JOURNAL_DELETE && d->meta.size) sbuf_append(sb, d->meta.data, d->meta.size);
+        r.size = sb->size - start;
+        memcpy(sb->data + start, &r.size, sizeof r.size);
+}
+
+/* Append a record of kind for deleted entry d */
+void
+journal_append(int kind, struct deleted_entry *d)
+{
+        static struct sbuf sb = { 0 };
+
+        if (journal.fd < 0) return;
+        sb.size = 0;
+        journal_write(&sb, kind, d);
+        flock(journal.fd, LOCK_EX);
+        if (write(journal.fd, sb.data, sb.size) != sb.size) error("Can not write undo journal");
+        flock(journal.fd, LOCK_UN);
+}
+
+/* Read the undo list from the journal, and rewrite it with the entries
+ * still in the trash. Every fl running holds the journal lock shared, and
+ * appends to the same file: it is only rewritten by a fl running alone */
+void
+journal_load()
+{
+        struct sbuf sb = { 0 }, out = { 0 };
+        struct journal_record r;
+        struct deleted_entry d;
+        char buf[64 * 1024], cwd[PATH_MAX], *home, *tmp;
+        const char *folder, *name, *trash, *meta, *end;
+        struct stat st;
+        ssize_t n;
+        int i, fd, off, ok, alone;
+
+        if (getcwd(cwd, sizeof cwd)) journal.cwd = strdup(cwd);
+        if (!(home = getenv("HOME"))) return;
+        journal.path = strconcat(home, "/" JOURNAL_FILE);
+        if (!home_trash()) return;
+        tmp = strconcat(journal.path, ".lock");
+        if ((journal.lock = open(tmp, O_RDONLY | O_CREAT | O_CLOEXEC, 0600)) < 0)
+                error("Can not open undo journal lock `%s`", tmp);
+        free(tmp);
+        alone = journal.lock >= 0 && !flock(journal.lock, LOCK_EX | LOCK_NB);
+        if (journal.lock >= 0 && !alone) flock(journal.lock, LOCK_SH);
+        if ((fd = open(journal.path, O_RDONLY | O_CLOEXEC)) >= 0) {
+                /* Not while another fl appends */
+                flock(fd, LOCK_SH);
+                while ((n = read(fd, buf, sizeof buf)) > 0)
+                        sbuf_append(&sb, buf, n);
+                close(fd);
+        }
+
+        /* A record cut by a crash, or otherwise broken, ends it */
+        for (off = 0; off + (int) sizeof r <= sb.size; off += r.size) {
+                memcpy(&r, sb.data + off, sizeof r);
+                if (r.size < sizeof r + 3 || r.size > sb.size - off) break;
+                end = sb.data + off + r.size;
+                folder = sb.data + off + sizeof r;
+                if (!(name = memchr(folder, 0, end - folder)) ||
+                    !(trash = memchr(name + 1, 0, end - name - 1)) ||
+                    !(meta = memchr(trash + 1, 0, end - trash - 1)))
+                        break;
+                name++;
+                trash++;
+                meta++;
+                if (r.kind == JOURNAL_DROP) {
+                        for (i = deleted_dir_arr.size - 1; i >= 0; i--)
+                                if (!strcmp(deleted_dir_arr.data[i].trash, trash)) break;
+                        if (i < 0) continue;
+                        deleted_free(&deleted_dir_arr.data[i]);
+                        da_remove(&deleted_dir_arr, i);
+                        continue;
+                }
+                /* Gone from the trash by other means */
+                if (lstat(trash, &st) && errno == ENOENT) continue;
+                d = (struct deleted_entry) {
+                        .path = strdup(folder),
+                        .name = strdup(name),
+                        .trash = strdup(trash),
+                        .type = r.type,
+                        .ino = r.ino,
+                        .batch = r.batch,
+                        .size = r.bytes,
+                };
+                /* If broken, its files are restored with the metadata of blobs */
+                if (end > meta && blob_meta_valid(meta, end - meta)) sbuf_append(&d.meta, meta, end - meta);
+                da_append(&deleted_dir_arr, d);
+                if (d.batch > journal.batch) journal.batch = d.batch;
+        }
+        free(sb.data);
+
+        if (alone) {
+                for (i = 0; i < deleted_dir_arr.size; i++)
+                        journal_write(&out, JOURNAL_DELETE, &deleted_dir_arr.data[i]);
+                tmp = strconcat(journal.path, ".XXXXXX");
+                ok = (fd = mkostemp(tmp, O_CLOEXEC)) >= 0 && write(fd, out.data, out.size) == out.size;
+                if (fd >= 0 && close(fd)) ok = 0;
+                if (!ok || rename(tmp, journal.path)) {
+                        error("Can not write undo journal `%s`", journal.path);
+                        if (fd >= 0) unlink(tmp);
+                }
+                free(tmp);
+                free(out.data);
+        }
+        if ((journal.fd = open(journal.path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600)) < 0)
+                error("Can not open undo journal `%s`", journal.path);
+        /* Others starting can now open it */
+        if (alone) flock(journal.lock, LOCK_SH);
+}
+
+/* File operations run as jobs in background, by at most JOB_WORKERS
+ * threads, so the UI does not wait for them. The tree is updated when they
+ * finish. A job acts on a batch of entries: their renames, removes and
+ * stats are sent together (see uring_run). Copies report their progress
+ * and can be canceled. */
+#define JOB_WORKERS 2
+#define JOB_REFRESH_MS 250
+
+enum {
+        JOB_DELETE,
+        JOB_RESTORE,
+        JOB_MOVE,
+        JOB_COPY,
+        JOB_PURGE,
+};
+
+static const char *JOB_NAMES[] = {
+        [JOB_DELETE] = "deleting",
+        [JOB_RESTORE] = "restoring",
+        [JOB_MOVE] = "moving",
+        [JOB_COPY] = "copying",
+        [JOB_PURGE] = "purging",
+};
+
+/* Entry a job acts on */
+struct job_item {
+        int dirfd;      /* Folder of the entry, or AT_FDCWD */
+        char *name;     /* Entry name from dirfd */
+        char *filename; /* Path, shown and logged */
+        struct deleted_entry d;
+        int failed;
+};
+
+typedef DA(struct job_item) job_item_da;
+
+struct job {
+        int type;
+        job_item_da items;
+        int_da fds;     /* Folders opened for the items, one per node */
+        int last_node;  /* Node the last fd is for */
+        int destfd;     /* Destination folder of moves and copies */
+        char *dest;
+        unsigned batch; /* Undo batch of the deleted entries */
+        long long done; /* Bytes copied */
+        long long total;
+        int cancel;
+        long long start; /* See perf_start */
+};
+
+typedef DA(struct job *) job_da;
+
+struct {
+        pthread_mutex_t lock;
+        pthread_cond_t wake;
+        pthread_cond_t idle;
+        job_da queue;  /* Waiting for a worker */
+        job_da done;   /* Finished, to be merged by the main thread */
+        int nthreads;
+        int pending;   /* Submitted and not finished */
+} jobs = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .wake = PTHREAD_COND_INITIALIZER,
+        .idle = PTHREAD_COND_INITIALIZER,
+};
+
+/* Jobs submitted by the main thread and not merged yet */
+job_da active_jobs = { 0 };
+
+static __thread struct job *current_job = NULL;
+
+/* Count n bytes copied by the current job. Return -1 if it was canceled */
+int
+job_progress(ssize_t n)
 {
-        char c;
-        if (read(STDIN_FILENO, &c, 1) != 1) {
-                error("Error reading from stdin");
-                abort();
+        if (!current_job) return 0;
+        __atomic_add_fetch(&current_job->done, n, __ATOMIC_RELAXED);
+        if (__atomic_load_n(&current_job->cancel, __ATOMIC_ACQUIRE)) {
+                errno = ECANCELED;
+                return -1;
         }
-        switch (c) {
-                /* Handle special stuff here */
+        return 0;
+}
+
+/* Count total bytes more to be copied by the current job */
+void
+job_start_copy(long long total)
+{
+        if (current_job) __atomic_add_fetch(&current_job->total, total, __ATOMIC_RELAXED);
+}
+
+int
+job_canceled(struct job *j)
+{
+        return __atomic_load_n(&j->cancel, __ATOMIC_ACQUIRE);
+}
+
+/* Log why item failed, errno being err */
+void
+job_fail(struct job *j, struct job_item *it, int err)
+{
+        errno = err;
+        it->failed = 1;
+        if (err == ECANCELED) return;
+        switch (j->type) {
+        case JOB_DELETE:
+                error("Can not move `%s` to trash", it->filename);
+                break;
+        case JOB_RESTORE:
+                error("Can not restore `%s`", it->filename);
+                break;
+        case JOB_PURGE:
+                error("Can not remove `%s` from trash", it->d.trash);
+                break;
         default:
-                return c;
+                error("Can not %s `%s` to `%s`", j->type == JOB_MOVE ? "move" : "copy", it->filename, j->dest);
         }
 }
 
+/* Rename the items with ops in a batch. Those in other filesystems are
+ * moved by copying them. Return how many were copied */
 int
-is_folder(struct dirent entry)
+job_rename(struct job *j, uring_op_da *ops, int_da *ids)
 {
-        switch (entry.d_type) {
-        case DT_DIR:
-                return 1;
-        case DT_LNK:
-                /* Todo: accept symlinks */
+        struct job_item *it;
+        struct uring_op *op;
+        int i, copies = 0;
+
+        if (job_canceled(j)) {
+                for (i = 0; i < ids->size; i++)
+                        j->items.data[ids->data[i]].failed = 1;
+                return 0;
+        }
+        uring_run(ops->data, ops->size);
+        for (i = 0; i < ops->size; i++) {
+                it = &j->items.data[ids->data[i]];
+                op = &ops->data[i];
+                if (op->res == -EXDEV) {
+                        copies++;
+                        /* Files copied to the trash are kept as blobs */
+                        copy_to_blobs = j->type == JOB_DELETE ? &it->d.meta : NULL;
+                        if (job_canceled(j))
+                                op->res = -ECANCELED;
+                        else if (move_tree(op->dirfd, op->path, op->dirfd2, op->path2))
+                                op->res = -errno;
+                        else
+                                op->res = 0;
+                        copy_to_blobs = NULL;
+                        /* Copied back: the files kept as blobs get their own
+                         * metadata */
+                        if (!op->res && j->type == JOB_RESTORE && blob_restore(op->path2, &it->d.meta))
+                                error("Can not set mode and times of `%s`", it->filename);
+                }
+                if (op->res) job_fail(j, it, -op->res);
+        }
+        return copies;
+}
+
+/* Move the items to the trash of their filesystems */
+void
+job_delete(struct job *j)
+{
+        static __thread uring_op_da ops = { 0 };
+        static __thread int_da ids = { 0 };
+        struct statx *stx = calloc(j->items.size + 1, sizeof *stx);
+        struct job_item *it;
+        int i;
+
+        assert(stx);
+        ops.size = 0;
+        for (i = 0; i < j->items.size; i++) {
+                it = &j->items.data[i];
+                da_append(&ops, ((struct uring_op) {
+                                        .opcode = IORING_OP_STATX,
+                                        .dirfd = it->dirfd,
+                                        .path = it->name,
+                                        .flags = AT_SYMLINK_NOFOLLOW,
+                                        .stx = &stx[i],
+                                }));
+        }
+        uring_run(ops.data, ops.size);
+        for (i = 0; i < j->items.size; i++)
+                if (ops.data[i].res) job_fail(j, &j->items.data[i], -ops.data[i].res);
+
+        ops.size = ids.size = 0;
+        for (i = 0; i < j->items.size; i++) {
+                it = &j->items.data[i];
+                if (it->failed) continue;
+                it->d.trash = trash_item(it->d.path, makedev(stx[i].stx_dev_major, stx[i].stx_dev_minor));
+                if (!it->d.trash) {
+                        it->failed = 1;
+                        continue;
+                }
+                da_append(&ids, i);
+                da_append(&ops, ((struct uring_op) {
+                                        .opcode = IORING_OP_RENAMEAT,
+                                        .dirfd = it->dirfd,
+                                        .path = it->name,
+                                        .dirfd2 = AT_FDCWD,
+                                        .path2 = it->d.trash,
+                                        .flags = RENAME_NOREPLACE,
+                                }));
+        }
+        free(stx);
+        job_rename(j, &ops, &ids);
+        for (i = 0; i < j->items.size; i++) {
+                it = &j->items.data[i];
+                if (!it->failed) {
+                        it->d.size = tree_size(AT_FDCWD, it->d.trash);
+                        continue;
+                }
+                free(it->d.trash);
+                it->d.trash = NULL;
+        }
+}
+
+/* Move the items back from the trash, or to the destination folder */
+void
+job_move(struct job *j)
+{
+        static __thread uring_op_da ops = { 0 };
+        static __thread int_da ids = { 0 };
+        struct job_item *it;
+        int i;
+
+        ops.size = ids.size = 0;
+        for (i = 0; i < j->items.size; i++) {
+                it = &j->items.data[i];
+                da_append(&ids, i);
+                if (j->type == JOB_RESTORE)
+                        da_append(&ops, ((struct uring_op) {
+                                                .opcode = IORING_OP_RENAMEAT,
+                                                .dirfd = AT_FDCWD,
+                                                .path = it->d.trash,
+                                                .dirfd2 = AT_FDCWD,
+                                                .path2 = it->filename,
+                                                .flags = RENAME_NOREPLACE,
+                                        }));
+                else
+                        da_append(&ops, ((struct uring_op) {
+                                                .opcode = IORING_OP_RENAMEAT,
+                                                .dirfd = it->dirfd,
+                                                .path = it->name,
+                                                .dirfd2 = j->destfd,
+                                                .path2 = it->d.name,
+                                                .flags = RENAME_NOREPLACE,
+                                        }));
+        }
+        /* Blobs copied back are not needed anymore */
+        if (job_rename(j, &ops, &ids) && j->type == JOB_RESTORE) blob_gc();
+}
+
+/* Remove the items from the trash */
+void
+job_purge(struct job *j)
+{
+        struct job_item *it;
+        int i;
+
+        for (i = 0; i < j->items.size; i++) {
+                it = &j->items.data[i];
+                if (remove_tree(AT_FDCWD, it->d.trash) && errno != ENOENT) job_fail(j, it, errno);
+        }
+        blob_gc();
+}
+
+/* Copy the items to the destination folder */
+void
+job_copy(struct job *j)
+{
+        static __thread uring_op_da ops = { 0 };
+        struct statx *stx = calloc(j->items.size + 1, sizeof *stx);
+        struct job_item *it;
+        int i, err;
+
+        assert(stx);
+        for (i = 0; i < j->items.size; i++) {
+                it = &j->items.data[i];
+                job_start_copy(tree_size(it->dirfd, it->name));
+        }
+        ops.size = 0;
+        for (i = 0; i < j->items.size; i++) {
+                it = &j->items.data[i];
+                if (job_canceled(j)) {
+                        it->failed = 1;
+                        continue;
+                }
+                if (copy_tree(it->dirfd, it->name, j->destfd, it->d.name)) {
+                        err = errno;
+                        /* Something was there already: keep it */
+                        if (err != EEXIST) remove_tree(j->destfd, it->d.name);
+                        job_fail(j, it, err);
+                        continue;
+                }
+                da_append(&ops, ((struct uring_op) {
+                                        .opcode = IORING_OP_STATX,
+                                        .dirfd = j->destfd,
+                                        .path = it->d.name,
+                                        .flags = AT_SYMLINK_NOFOLLOW,
+                                        .stx = &stx[i],
+                                }));
+        }
+        /* Copies are new inodes */
+        uring_run(ops.data, ops.size);
+        for (i = 0; i < j->items.size; i++)
+                if (stx[i].stx_mask) j->items.data[i].d.ino = stx[i].stx_ino;
+        free(stx);
+}
+
+void
+job_run(struct job *j)
+{
+        switch (j->type) {
+        case JOB_DELETE:
+                job_delete(j);
+                break;
+        case JOB_RESTORE:
+        case JOB_MOVE:
+                job_move(j);
+                break;
+        case JOB_COPY:
+                job_copy(j);
+                break;
+        case JOB_PURGE:
+                job_purge(j);
+                break;
+        }
+}
+
+void *
+job_worker(void *arg)
+{
+        struct job *j;
+
+        for (;;) {
+                pthread_mutex_lock(&jobs.lock);
+                while (!jobs.queue.size)
+                        pthread_cond_wait(&jobs.wake, &jobs.lock);
+                j = jobs.queue.data[0];
+                da_remove(&jobs.queue, 0);
+                pthread_mutex_unlock(&jobs.lock);
+
+                current_job = j;
+                perf_scope = PERF_DELETE + j->type;
+                job_run(j);
+                perf_scope = NONE;
+                current_job = NULL;
+
+                pthread_mutex_lock(&jobs.lock);
+                da_append(&jobs.done, j);
+                if (!--jobs.pending) pthread_cond_broadcast(&jobs.idle);
+                pthread_mutex_unlock(&jobs.lock);
+                if (write(posts.efd, &(uint64_t) { 1 }, sizeof(uint64_t)) < 0)
+                        error("Can not wake up main thread");
+        }
+        return NULL;
+}
+
+void job_process();
+void job_free(struct job *j);
+
+void
+job_submit(struct job *j)
+{
+        pthread_t thread;
+
+        if (!j->items.size) {
+                job_free(j);
+                return;
+        }
+        j->start = perf_start();
+        pthread_mutex_lock(&jobs.lock);
+        da_append(&jobs.queue, j);
+        jobs.pending++;
+        if (jobs.nthreads < JOB_WORKERS && jobs.nthreads < jobs.pending) {
+                if (pthread_create(&thread, NULL, job_worker, NULL)) {
+                        error("Can not create job worker");
+                } else {
+                        pthread_detach(thread);
+                        jobs.nthreads++;
+                }
+        }
+        pthread_cond_signal(&jobs.wake);
+        pthread_mutex_unlock(&jobs.lock);
+        da_append(&active_jobs, j);
+        if (!jobs.nthreads) {
+                /* No workers: run it here */
+                pthread_mutex_lock(&jobs.lock);
+                da_remove(&jobs.queue, jobs.queue.size - 1);
+                jobs.pending--;
+                da_append(&jobs.done, j);
+                pthread_mutex_unlock(&jobs.lock);
+                current_job = j;
+                perf_scope = PERF_DELETE + j->type;
+                job_run(j);
+                perf_scope = NONE;
+                current_job = NULL;
+                job_process();
+        }
+}
+
+struct job *
+job_new(int type)
+{
+        struct job *j = calloc(1, sizeof *j);
+
+        assert(j);
+        j->type = type;
+        j->last_node = NONE;
+        j->destfd = -1;
+        return j;
+}
+
+/* Add the entry at row to job j */
+void
+job_add_row(struct job *j, int row)
+{
+        static struct sbuf buf = { 0 };
+        struct entry *entry = &ROW(row);
+        struct job_item it = { 0 };
+        const char *name;
+        int fd;
+
+        it.filename = strconcat(PATH(entry), "/", NAME(entry));
+        fd = entry_at(entry, &buf, &name);
+        /* The folder could be collapsed while the job runs: it gets its
+         * own descriptor, shared by the entries next to it */
+        if (fd != AT_FDCWD && j->last_node != entry->parent) {
+                da_append(&j->fds, dup(fd));
+                j->last_node = entry->parent;
+        }
+        it.dirfd = fd == AT_FDCWD ? AT_FDCWD : j->fds.data[j->fds.size - 1];
+        if (it.dirfd < 0) {
+                it.dirfd = AT_FDCWD;
+                j->last_node = NONE;
+                name = it.filename;
+        }
+        it.name = strdup(name);
+        it.d.path = journal_folder(PATH(entry));
+        it.d.name = strdup(NAME(entry));
+        it.d.type = entry->type;
+        it.d.ino = entry->ino;
+        da_append(&j->items, it);
+}
+
+/* Whether entry e is in a marked folder */
+int
+mark_inherited(int e)
+{
+        int n;
+        for (n = entries.data[e].parent; nodes.data[n].entry != NONE; n = entries.data[nodes.data[n].entry].parent)
+                if (entries.data[nodes.data[n].entry].marked) return 1;
+        return 0;
+}
+
+/* Rows the batch operations act on: the marked ones, or the selected one.
+ * Entries in a marked folder go with it */
+void
+batch_rows(int_da *rows)
+{
+        const int *all;
+        int i;
+
+        rows->size = 0;
+        if (marked_count) {
+                all = view_rows();
+                for (i = 0; i < view.size; i++)
+                        if (entries.data[all[i]].marked && !mark_inherited(all[i])) da_append(rows, i);
+        } else if (shown_count())
+                da_append(rows, selected_row);
+}
+
+/* Delete the marked entries, or the selected one, in background */
+void
+delete_rows()
+{
+        static int_da rows = { 0 };
+        struct job *j = job_new(JOB_DELETE);
+        int i;
+
+        batch_rows(&rows);
+        j->batch = ++journal.batch;
+        for (i = 0; i < rows.size; i++)
+                job_add_row(j, rows.data[i]);
+        mark_clear();
+        job_submit(j);
+}
+
+/* Restore the last entries deleted together, in background */
+void
+undo_delete()
+{
+        struct job *j;
+        struct job_item it = { 0 };
+        unsigned batch;
+
+        if (!deleted_dir_arr.size) return;
+        j = job_new(JOB_RESTORE);
+        batch = deleted_dir_arr.data[deleted_dir_arr.size - 1].batch;
+        while (deleted_dir_arr.size && deleted_dir_arr.data[deleted_dir_arr.size - 1].batch == batch) {
+                it.dirfd = AT_FDCWD;
+                it.d = deleted_dir_arr.data[--deleted_dir_arr.size];
+                it.filename = strconcat(it.d.path, "/", it.d.name);
+                da_append(&j->items, it);
+        }
+        job_submit(j);
+}
+
+/* Move (or copy) the marked entries, or the selected one, to the selected
+ * folder, or the folder of the selected entry */
+void
+move_rows(int type)
+{
+        static int_da rows = { 0 };
+        struct entry *target;
+        struct job *j;
+        const char *filename;
+        int i, len;
+
+        if (!shown_count()) return;
+        target = &ROW(selected_row);
+        j = job_new(type);
+        j->dest = is_folder(target) ? strconcat(PATH(target), "/", NAME(target)) : strdup(PATH(target));
+        if ((j->destfd = open(j->dest, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+                error("Can not open `%s`", j->dest);
+                job_free(j);
+                return;
+        }
+        batch_rows(&rows);
+        for (i = 0; i < rows.size; i++) {
+                job_add_row(j, rows.data[i]);
+                /* A folder can not go into itself */
+                filename = j->items.data[i].filename;
+                len = strlen(filename);
+                if (!strncmp(j->dest, filename, len) && (j->dest[len] == '/' || !j->dest[len])) {
+                        warn("Can not %s `%s` into itself", type == JOB_MOVE ? "move" : "copy", filename);
+                        job_free(j);
+                        return;
+                }
+        }
+        mark_clear();
+        job_submit(j);
+}
+
+/* Remove the entries deleted first from the trash while it is bigger than
+ * journal.max. The last ones deleted are always kept */
+void
+trash_evict()
+{
+        struct job_item it = { .dirfd = AT_FDCWD };
+        long long size = 0;
+        struct job *j;
+        unsigned last;
+        int i, n;
+
+        for (i = 0; i < deleted_dir_arr.size; i++)
+                size += deleted_dir_arr.data[i].size;
+        if (size <= journal.max) return;
+
+        j = job_new(JOB_PURGE);
+        last = deleted_dir_arr.data[deleted_dir_arr.size - 1].batch;
+        for (n = 0; size > journal.max && deleted_dir_arr.data[n].batch != last; n++) {
+                it.d = deleted_dir_arr.data[n];
+                it.filename = strconcat(it.d.path, "/", it.d.name);
+                size -= it.d.size;
+                journal_append(JOURNAL_DROP, &it.d);
+                da_append(&j->items, it);
+        }
+        info("Trash over %lld MiB: purging %d entries", journal.max >> 20, n);
+        deleted_dir_arr.size -= n;
+        memmove(deleted_dir_arr.data, deleted_dir_arr.data + n, deleted_dir_arr.size * sizeof *deleted_dir_arr.data);
+        job_submit(j);
+}
+
+/* Remove the deleted entry d from the tree, if its folder is loaded */
+void
+drop_entry(struct deleted_entry *d)
+{
+        int i, n, e;
+
+        if ((n = folder_node(d->path)) == NONE) return;
+        for (i = 0; i < nodes.data[n].children.size; i++) {
+                e = nodes.data[n].children.data[i];
+                if (strcmp(NAME(&entries.data[e]), d->name)) continue;
+                drop_row(entry_row(e));
+                if (selected_row >= view.size && selected_row) selected_row = view.size - 1;
+                return;
+        }
+}
+
+void
+job_free(struct job *j)
+{
+        int i;
+
+        /* The entries not merged are still owned by the job */
+        for (i = 0; i < j->items.size; i++) {
+                free(j->items.data[i].name);
+                free(j->items.data[i].filename);
+                deleted_free(&j->items.data[i].d);
+        }
+        for (i = 0; i < j->fds.size; i++)
+                if (j->fds.data[i] >= 0) close(j->fds.data[i]);
+        if (j->destfd >= 0) close(j->destfd);
+        free(j->items.data);
+        free(j->fds.data);
+        free(j->dest);
+        free(j);
+}
+
+/* Merge job j, finished, in the tree and the undo list */
+void
+job_merge(struct job *j)
+{
+        struct deleted_entry *d;
+        int i;
+
+        /* Restores failed go back to the undo list in the order they had */
+        for (i = j->type == JOB_RESTORE ? j->items.size - 1 : 0;
+             i >= 0 && i < j->items.size;
+             i += j->type == JOB_RESTORE ? -1 : 1) {
+                d = &j->items.data[i].d;
+                switch (j->type) {
+                case JOB_DELETE:
+                        if (j->items.data[i].failed) {
+                                deleted_free(d);
+                                break;
+                        }
+                        drop_entry(d);
+                        d->batch = j->batch;
+                        journal_append(JOURNAL_DELETE, d);
+                        da_append(&deleted_dir_arr, *d);
+                        break;
+                case JOB_RESTORE:
+                        if (j->items.data[i].failed) {
+                                /* Still in the trash: it can be undone again */
+                                da_append(&deleted_dir_arr, *d);
+                                break;
+                        }
+                        journal_append(JOURNAL_DROP, d);
+                        restore_entry(d);
+                        deleted_free(d);
+                        break;
+                case JOB_PURGE:
+                        deleted_free(d);
+                        break;
+                case JOB_MOVE:
+                case JOB_COPY:
+                        if (!j->items.data[i].failed) {
+                                if (j->type == JOB_MOVE) drop_entry(d);
+                                free(d->path);
+                                d->path = journal_folder(j->dest);
+                                restore_entry(d);
+                        }
+                        deleted_free(d);
+                        break;
+                }
+                /* Handed over to the undo list or freed */
+                *d = (struct deleted_entry) { 0 };
+        }
+        if (j->type == JOB_DELETE) trash_evict();
+}
+
+/* Merge the jobs finished in the tree */
+void
+job_process()
+{
+        static job_da done = { 0 };
+        struct job *j;
+        job_da tmp;
+        int i, k;
+
+        pthread_mutex_lock(&jobs.lock);
+        tmp = jobs.done;
+        jobs.done = done;
+        done = tmp;
+        pthread_mutex_unlock(&jobs.lock);
+
+        for (i = 0; i < done.size; i++) {
+                j = done.data[i];
+                for (k = 0; k < active_jobs.size; k++)
+                        if (active_jobs.data[k] == j) da_remove(&active_jobs, k);
+                debug("Job done: %s %d entries", JOB_NAMES[j->type], j->items.size);
+                perf_end(PERF_DELETE + j->type, j->start, j->items.size);
+                perf_add(PERF_DELETE + j->type, bytes, j->done);
+                job_merge(j);
+                job_free(j);
+        }
+        done.size = 0;
+}
+
+/* Cancel every job. Entries being copied are left as they were */
+void
+job_cancel_all()
+{
+        int i;
+        for (i = 0; i < active_jobs.size; i++)
+                __atomic_store_n(&active_jobs.data[i]->cancel, 1, __ATOMIC_RELEASE);
+}
+
+/* Cancel every job and wait for the workers to drop them */
+void
+job_finish_all()
+{
+        job_cancel_all();
+        pthread_mutex_lock(&jobs.lock);
+        while (jobs.pending)
+                pthread_cond_wait(&jobs.idle, &jobs.lock);
+        pthread_mutex_unlock(&jobs.lock);
+}
+
+/* Append the progress of the jobs to sb */
+void
+job_status(struct sbuf *sb)
+{
+        struct job *j;
+        long long done, total;
+
+        if (!active_jobs.size) return;
+        j = active_jobs.data[0];
+        if (j->items.size == 1)
+                sbuf_printf(sb, " %s %s", JOB_NAMES[j->type], j->items.data[0].filename);
+        else
+                sbuf_printf(sb, " %s %d entries", JOB_NAMES[j->type], j->items.size);
+        done = __atomic_load_n(&j->done, __ATOMIC_RELAXED);
+        total = __atomic_load_n(&j->total, __ATOMIC_RELAXED);
+        if (total) sbuf_printf(sb, " %d%%", (int) (done * 100 / total));
+        if (active_jobs.size > 1) sbuf_printf(sb, " (+%d)", active_jobs.size - 1);
+}
+
+#define TRIM_R(string)                                 \
+        do {                                           \
+                char *c = string + strlen(string) - 1; \
+                if (c < string) break;                 \
+                while (c >= string && isspace(*c))     \
+                        --c;                           \
+                c[1] = 0;                              \
+        } while (0)
+
+
+void
+search_done(const char *text)
+{
+        char pattern[sizeof prompt.text];
+
+        strcpy(pattern, text);
+        TRIM_R(pattern);
+        search_set(pattern);
+        search_next(1);
+}
+
+void
+search()
+{
+        prompt.active = 1;
+        prompt.label = "search >> ";
+        prompt.len = 0;
+        prompt.done = search_done;
+        prompt.changed = NULL;
+        prompt.cancel = NULL;
+}
+
+void
+search_global_done(const char *text)
+{
+        char pattern[sizeof prompt.text];
+
+        strcpy(pattern, text);
+        TRIM_R(pattern);
+        search_set(pattern);
+        finder.global = 1;
+        search_next(1);
+}
+
+/* Search the whole tree under the working directory, in the index */
+void
+search_global()
+{
+        search();
+        prompt.label = "index search >> ";
+        prompt.done = search_global_done;
+}
+
+void
+filter_cancel()
+{
+        filter_set("");
+}
+
+/* Edit the filter query. It is applied as it is typed */
+void
+filter_prompt()
+{
+        prompt.active = 1;
+        prompt.label = filter.fuzzy ? "fuzzy filter >> " : "filter >> ";
+        prompt.len = snprintf(prompt.text, sizeof prompt.text, "%s", filter.query);
+        prompt.done = NULL;
+        prompt.changed = filter_set;
+        prompt.cancel = filter_cancel;
+}
+
+/* Keys that are sent as escape sequences */
+enum {
+        KEY_ESC = 0x1b,
+        KEY_UP = 0x100,
+        KEY_DOWN,
+        KEY_RIGHT,
+        KEY_LEFT,
+        KEY_HOME,
+        KEY_END,
+        KEY_PGUP,
+        KEY_PGDN,
+        KEY_NONE,
+};
+
+/* Decode the key at s, with n bytes available. Return its length. An escape
+ * not followed by a complete sequence is a lone Esc. */
+int
+parse_key(const unsigned char *s, int n, int *key)
+{
+        int i;
+
+        *key = s[0];
+        if (s[0] != 0x1b || n == 1 || (s[1] != '[' && s[1] != 'O')) return 1;
+
+        for (i = 2; i < n && (isdigit(s[i]) || s[i] == ';'); i++)
+                ;
+        if (i == n) return 1;
+
+        switch (s[i]) {
+        case 'A': *key = KEY_UP; break;
+        case 'B': *key = KEY_DOWN; break;
+        case 'C': *key = KEY_RIGHT; break;
+        case 'D': *key = KEY_LEFT; break;
+        case 'H': *key = KEY_HOME; break;
+        case 'F': *key = KEY_END; break;
+        case '~':
+                switch (atoi((const char *) s + 2)) {
+                case 1:
+                case 7: *key = KEY_HOME; break;
+                case 4:
+                case 8: *key = KEY_END; break;
+                case 5: *key = KEY_PGUP; break;
+                case 6: *key = KEY_PGDN; break;
+                default: *key = KEY_NONE; break;
+                }
+                break;
         default:
-                return 0;
+                *key = KEY_NONE;
+                break;
         }
+        return i + 1;
 }
 
 void
-place_cursor_midwindow()
+prompt_key(int key)
 {
-        selected_row = dir_arr.size / 2;
-        woffset = (wsize.ws_row >= dir_arr.size) ?
-                  0 :
-                  selected_row - wsize.ws_row / 2;
+        switch (key) {
+        case 13:
+                prompt.active = 0;
+                prompt.text[prompt.len] = 0;
+                if (prompt.done) prompt.done(prompt.text);
+                break;
+        case KEY_ESC:
+        case 0x3: /* C-c */
+                prompt.active = 0;
+                if (prompt.cancel) prompt.cancel();
+                break;
+        case 0x7f:
+        case '\b':
+                if (!prompt.len) break;
+                --prompt.len;
+                goto changed;
+        default:
+                if (key < ' ' || key > 0xff) break;
+                if (prompt.len == (int) sizeof prompt.text - 1) break;
+                prompt.text[prompt.len++] = key;
+        changed:
+                prompt.text[prompt.len] = 0;
+                if (prompt.changed) prompt.changed(prompt.text);
+                break;
+        }
 }
 
+int quit = 0;
 
 void
-change_dir()
+handle_key(int key)
 {
-        char path[1024];
-
-        staticstrconcat(path, 1024,
-                        dir_arr.data[selected_row].path, "/",
-                        dir_arr.data[selected_row].dirent.d_name);
+        int page = wsize.ws_row > 2 ? wsize.ws_row - 2 : 1;
 
-        if (!is_folder(dir_arr.data[selected_row].dirent)) {
-                report("Can not change dir to %s: it is not a folder", path);
+        if (prompt.active) {
+                prompt_key(key);
                 return;
         }
-        if (chdir(path)) {
-                error("Can not change dir to %s", path);
-                return;
-        }
-
-        dir_arr.size = 0;
-        add_subfolder(".", NULL, -1);
-        place_cursor_midwindow();
-}
+        cursor_pending = 0;
 
-/* TODO: this is ugly as fuck. Noodle code :) */
-int
-create_filename_path_if_not_exists(const char *path)
-{
-        char *full_path = strdup(path);
-        char *current_path = full_path;
-        char *curr_dir = full_path;
-        struct stat buf;
+        switch (key) {
+        case 'q':
+        case 0x3: /* C-c */
+                quit = 1;
+                break;
 
-        while ((current_path = strchr(current_path, '/'))) {
-                *current_path = 0;
-                if (stat(full_path, &buf) != -1)
-                        ; // check if dir exists
-                else if (*full_path == 0)
-                        ; // check if full path is not empty
-                else if (!strcmp(".", curr_dir))
-                        ; // check if curr_dir is not '.'
-                else if (mkdir(full_path, 0700)) {
-                        error("Can't mkdir `%s`", full_path);
-                        free(full_path);
-                        return -1;
+        case KEY_ESC:
+                if (filter.active)
+                        filter_set("");
+                else {
+                        load_cancel_all();
+                        tree_cancel_all();
                 }
-                /* Restore '/' and point to the first char after the '/' */
-                *(current_path++) = '/';
-                curr_dir = current_path;
-        }
+                break;
 
-        free(full_path);
-        return 0;
-}
+        case 'k':
+        case KEY_UP:
+                cursor_set(cursor_pos() - 1);
+                break;
+        case 'j':
+        case KEY_DOWN:
+                cursor_set(cursor_pos() + 1);
+                break;
+        case KEY_PGUP:
+                cursor_set(cursor_pos() - page);
+                break;
+        case KEY_PGDN:
+                cursor_set(cursor_pos() + page);
+                break;
 
-int
-store_remove(const char *filename)
-{
-        char buffer[1024 * 1024];
-        int fd_in, fd_out;
-        char backup_filename[1024];
-        ssize_t n;
+        case 'K':
+                if (!shown_count()) break;
+                selected_row = move_row(selected_row, -1);
+                break;
+        case 'J':
+                if (!shown_count()) break;
+                selected_row = move_row(selected_row, 1);
+                break;
 
-        staticstrconcat(backup_filename, 1024, UNDO_BACKUP_DIR, "/", filename);
-        if (create_filename_path_if_not_exists(backup_filename)) {
-                error("Can not create path for file: `%s`", backup_filename);
-                return -1;
-        }
+        case 'd':
+                if (do_not_delete || !shown_count()) break;
+                delete_rows();
+                break;
 
-        fd_out = open(backup_filename, O_CREAT | O_WRONLY, 0600);
-        /* Todo: use prev permissions */
-        if (fd_out < 0) {
-                error("Can not create file: `%s`", backup_filename);
-                return -1;
-        }
+        case 'u':
+                undo_delete();
+                break;
 
-        fd_in = open(filename, O_RDONLY, 0600);
-        /* Todo: use prev permissions */
-        if (fd_in < 0) {
-                error("Can not open file: `%s`", filename);
-                return -1;
-        }
+        case 'C':
+                job_cancel_all();
+                break;
 
-        while ((n = read(fd_in, buffer, sizeof buffer)))
-                if (write(fd_out, buffer, n) != n) {
-                        error("Error writing file: `%s`", filename);
-                        return -1;
-                }
+        case 'm':
+                mark_toggle();
+                break;
+        case 'V':
+                mark_range();
+                break;
+        case '*':
+                mark_matches();
+                break;
+        case 'M':
+                mark_clear();
+                break;
 
-        if (n < 0) {
-                error("Error reading file: `%s`", backup_filename);
-                return -1;
-        }
+        case 'i':
+                metadata.columns = !metadata.columns;
+                break;
+        case 'r':
+                meta_refresh();
+                tree_refresh();
+                break;
+        case 'z':
+                tree_rows();
+                break;
+        case 'Z':
+                trees.automatic = !trees.automatic;
+                break;
+        case 'S':
+                perf.overlay = !perf.overlay;
+                break;
+        case 'p':
+                move_rows(JOB_COPY);
+                break;
+        case 'P':
+                move_rows(JOB_MOVE);
+                break;
 
-        if (remove(filename)) {
-                error("Can't remove `%s`", filename);
-                return -1;
-        }
+        case ' ':
+                if (!shown_count()) break;
+                change_dir();
+                break;
 
-        return 0;
+        case '/':
+                search();
+                break;
+        case '?':
+                search_global();
+                break;
+        case 'n':
+                search_next(1);
+                break;
+        case 'N':
+                search_next(-1);
+                break;
+
+        case 13:
+        case '\b': // backspace
+                if (!shown_count()) break;
+                if (!is_folder(&ROW(selected_row))) {
+                        edit_file(NAME(&ROW(selected_row)), PATH(&ROW(selected_row)));
+                } else if (is_folder_open(selected_row))
+                        remove_subfolder(selected_row);
+                else
+                        add_subfolder(selected_row, 1);
+                break;
+
+        case 'E':
+                if (!shown_count() || !is_folder(&ROW(selected_row))) break;
+                if (is_folder_open(selected_row))
+                        remove_subfolder(selected_row);
+                add_subfolder(selected_row, recursive_depth);
+                break;
+
+        case 's':
+                sort();
+                break;
+        case 'o':
+                sort_order = (sort_order + 1) % SORT_COUNT;
+                sort();
+                break;
+
+        case 'f':
+                filter_prompt();
+                break;
+        case 'F':
+                filter_toggle_fuzzy();
+                break;
+
+        case 'g':
+        case KEY_HOME:
+                cursor_set(0);
+                break;
+        case 'G':
+        case KEY_END:
+                cursor_set(shown_count() - 1);
+                break;
+
+        default:
+                break;
+        }
 }
 
-int
-restore(const char *filename)
+/* Write what --list buffered to stdout */
+void
+list_flush()
 {
-        char buffer[1024 * 1024];
-        int fd_in, fd_out;
-        char *backup_filename;
         ssize_t n;
+        int off = 0;
 
-        fd_out = open(filename, O_CREAT | O_WRONLY, 0600);
-        /* Todo: use prev permissions */
-        if (fd_out < 0) {
-                error("Can not create file `%s`\n", filename);
-                goto __error_exit;
+        while (off < lister.out.size) {
+                n = write(STDOUT_FILENO, lister.out.data + off, lister.out.size - off);
+                if (n < 0 && errno == EINTR) continue;
+                if (n < 0) {
+                        error("Can not write the list");
+                        exit(1);
+                }
+                off += n;
         }
+        lister.out.size = 0;
+}
+
+/* Add dir/name to the list if it matches the pattern, matched like / does
+ * but against the path as written */
+void
+list_print(const char *dir, const char *name, int namelen)
+{
+        struct sbuf *out = &lister.out;
+        int len, hit, start = out->size;
+        char *path;
 
-        backup_filename = strconcat(UNDO_BACKUP_DIR, "/", filename);
-        fd_in = open(backup_filename, O_RDONLY, 0600);
-        /* Todo: use prev permissions */
-        if (fd_in < 0) {
-                error("Can not open file: `%s`\n", backup_filename);
-                goto __error_exit;
+        if (!strncmp(dir, "./", 2)) dir += 2;
+        if (!strncmp(dir, "//", 2)) dir++; /* Under the root folder */
+        if (strcmp(dir, ".")) {
+                sbuf_puts(out, dir);
+                if (dir[strlen(dir) - 1] != '/') sbuf_append(out, "/", 1);
         }
+        sbuf_append(out, name, namelen + 1);
+        out->size--;
 
-        while ((n = read(fd_in, buffer, sizeof buffer)))
-                if (write(fd_out, buffer, n) != n) {
-                        error("Error writing file: `%s`", filename);
-                        goto __error_exit;
+        if (finder.compiled) {
+                path = out->data + start;
+                len = out->size - start;
+                if (finder.litlen && !search_find(path, len, finder.lit, finder.litlen))
+                        hit = 0;
+                else
+                        hit = (finder.litlen && finder.plain) || !regexec(&finder.regex, path, 0, NULL, 0);
+                if (!hit) {
+                        out->size = start;
+                        return;
                 }
-
-        if (n < 0) {
-                error("Error reading file: `%s`", backup_filename);
-                goto __error_exit;
         }
+        sbuf_append(out, &lister.sep, 1);
+        if (out->size >= LIST_BUFFER) list_flush();
+}
 
-        /* I dont like how the following code looks like. TODO: refactoring */
-        free(backup_filename);
-        return 0;
-__error_exit:
-        free(backup_filename);
-        return -1;
+/* Path of the folder of l. It is set with its first batch, which always
+ * comes after the first of its parent */
+const char *
+list_path(struct listing *l)
+{
+        if (!l->path)
+                l->path = l->parent ? strconcat(list_path(l->parent), "/", l->name) : strdup(l->name);
+        return l->path;
 }
 
+/* Folder of l could not be read: tell it on stderr, as find does */
 void
-select_matching_file(const char *restrict pattern)
+list_error(struct listing *l)
 {
-        int cflags = REG_EXTENDED | REG_ICASE | REG_NEWLINE;
-        int eflags = 0;
-        regex_t regex;
-        regmatch_t pmatch[1];
-        size_t nmatch = 0;
-        char *input;
-        int i;
-        int errcode;
-        char buf[1024];
-        int offset;
-        int size;
+        const char *path = list_path(l);
 
-        if (pattern[0] == 0) return;
+        if (!strncmp(path, "./", 2)) path += 2;
+        fprintf(stderr, "fl: %s: %s\n", path, strerror(l->err));
+        lister.status = 1;
+}
 
-        if ((errcode = regcomp(&regex, pattern, cflags))) {
-                size = regerror(errcode, &regex, buf, sizeof buf);
-                report("regcomp error: %*s", size, buf);
-        }
-        for (offset = 1; offset < dir_arr.size; offset++) {
-                i = (offset + selected_row) % dir_arr.size;
-                staticstrconcat(buf, sizeof(buf) - 1,
-                                dir_arr.data[i].path, "/",
-                                dir_arr.data[i].dirent.d_name);
-                if (regexec(&regex, buf, 1, pmatch, eflags) != REG_NOMATCH) {
-                        selected_row = i;
-                        break;
-                }
+/* Write a batch posted by a worker, unordered */
+void
+list_batch(struct batch *b)
+{
+        struct listing *l = b->l;
+        struct raw_entry *raw;
+        const char *name;
+        int i;
+
+        list_path(l);
+        perf_add(PERF_READ, entries, b->ents.size);
+        for (i = 0; i < b->ents.size; i++) {
+                raw = &b->ents.data[i];
+                name = b->names.data + raw->name;
+                if (strcmp(name, "..")) list_print(l->path, name, raw->namelen);
         }
-        regfree(&regex);
+        free(b->names.data);
+        free(b->ents.data);
 }
 
-#define TRIM_R(string)                                 \
-        do {                                           \
-                char *c = string + strlen(string) - 1; \
-                if (c < string) break;                 \
-                while (c >= string && isspace(*c))     \
-                        --c;                           \
-                c[1] = 0;                              \
-        } while (0)
-
+/* Whether node n was read, or is not being read */
+int
+list_node_read(int n)
+{
+        return !nodes.data[n].listing || nodes.data[n].listing->finished;
+}
 
+/* Write the tree depth first, sorted, as far as the folders read allow.
+ * Folders are freed once written. */
 void
-search()
+list_step()
 {
-        soft_disable_custom_mode();
-        fgets(pattern, sizeof pattern - 1, stdin);
-        TRIM_R(pattern);
-        enable_custom_mode();
-        select_matching_file(pattern);
+        struct entry *e;
+        int n, k, folder;
+
+        for (;;) {
+                if (!lister.stack.size) {
+                        if (lister.root == roots.size || !list_node_read(roots.data[lister.root])) return;
+                        da_append(&lister.stack, roots.data[lister.root++]);
+                        da_append(&lister.next, 0);
+                }
+                n = lister.stack.data[lister.stack.size - 1];
+                k = lister.next.data[lister.next.size - 1];
+                if (!list_node_read(n)) return;
+                if (k == nodes.data[n].children.size) {
+                        lister.stack.size--;
+                        lister.next.size--;
+                        node_free(n);
+                        continue;
+                }
+
+                e = &entries.data[nodes.data[n].children.data[k]];
+                folder = e->type == DT_DIR && strcmp(NAME(e), "..");
+                /* Its node comes with its first batch */
+                if (folder && e->node == NONE && loads.size &&
+                    (!lister.depth || lister.stack.size < lister.depth))
+                        return;
+                lister.next.data[lister.next.size - 1]++;
+                if (!strcmp(NAME(e), "..")) continue;
+                list_print(PATH(e), NAME(e), e->namelen);
+                if (e->node != NONE) {
+                        da_append(&lister.stack, e->node);
+                        da_append(&lister.next, 0);
+                }
+        }
 }
 
-void
-mainloop()
+/* Write the paths under the folders in paths (or the working directory),
+ * up to depth levels, with the same workers that read them for the view */
+int
+list_run(char **paths, int count, int depth)
 {
-        int action;
-        int quit = 0;
-        char *filename;
-        struct extend_dirent temp;
+        struct pollfd p;
+        int i, len;
 
-        enable_custom_mode();
-        refresh();
+        if ((posts.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+                report("Can't create event fd: %s", strerror(errno));
+                return -1;
+        }
+        /* Unordered, no node keeps the folders */
+        if (!lister.ordered) max_open_dirs = 0;
+        lister.depth = depth;
 
-        while (!quit) {
-                action = getkey();
+        for (i = 0; i < count; i++) {
+                for (len = strlen(paths[i]); len > 1 && paths[i][len - 1] == '/';)
+                        paths[i][--len] = 0;
+                add_root(paths[i], depth);
+        }
+        if (!count) add_root(".", depth);
 
-                switch (action) {
-                case 'q':
-                case 0x3: /* C-c */
-                        quit = 1;
-                        break;
+        p = (struct pollfd) { .fd = posts.efd, .events = POLLIN };
+        while (loads.size) {
+                if (poll(&p, 1, -1) < 0 && errno != EINTR) {
+                        error("Error polling events");
+                        return -1;
+                }
+                load_process();
+                if (lister.ordered) list_step();
+        }
+        if (lister.ordered) list_step();
+        list_flush();
+        return lister.status;
+}
 
-                case 'k':
-                        if (!selected_row--) selected_row = 0;
-                        refresh();
-                        break;
-                case 'j':
-                        if (++selected_row >= dir_arr.size) selected_row--;
-                        refresh();
-                        break;
+/* Event loop. Waits for input, resizes and workers at once, and renders at
+ * most one frame per iteration, however many events were handled. */
+void
+mainloop()
+{
+        unsigned char buf[256];
+        struct signalfd_siginfo si;
+        struct pollfd fds[4];
+        int dirty = 1;
+        int timeout;
+        int sigfd;
+        sigset_t mask;
+        ssize_t n;
+        int i, len, key;
 
-                case 'K':
-                        if (selected_row == 0) break;
-                        temp = dir_arr.data[selected_row];
-                        dir_arr.data[selected_row] =
-                        dir_arr.data[selected_row - 1];
-                        dir_arr.data[selected_row - 1] = temp;
-                        --selected_row;
-                        refresh();
-                        break;
-                case 'J':
-                        if (selected_row >= dir_arr.size - 1) break;
-                        temp = dir_arr.data[selected_row];
-                        dir_arr.data[selected_row] =
-                        dir_arr.data[selected_row + 1];
-                        dir_arr.data[selected_row + 1] = temp;
-                        ++selected_row;
-                        refresh();
-                        break;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGWINCH);
+        if ((sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+                error("Can not create signal fd");
 
-                case 'd':
-                        if (do_not_delete) break;
-                        temp = dir_arr.data[selected_row];
-                        filename = strconcat(temp.path, "/", temp.dirent.d_name);
-                        if (store_remove(filename)) break;
-                        free(filename);
-                        da_append(&deleted_dir_arr, temp);
-                        da_remove(&dir_arr, selected_row);
-                        if (selected_row == dir_arr.size) --selected_row;
-                        refresh();
-                        break;
+        fds[0] = (struct pollfd) { .fd = STDIN_FILENO, .events = POLLIN };
+        fds[1] = (struct pollfd) { .fd = sigfd, .events = POLLIN };
+        fds[2] = (struct pollfd) { .fd = posts.efd, .events = POLLIN };
+        fds[3] = (struct pollfd) { .fd = watch.fd, .events = POLLIN };
 
-                case 'u':
-                        if (deleted_dir_arr.size == 0) break;
-                        temp = deleted_dir_arr.data[--deleted_dir_arr.size];
-                        filename = strconcat(temp.path, "/", temp.dirent.d_name);
-                        restore(filename);
-                        free(filename);
-                        da_append(&dir_arr, temp);
-                        sort();
-                        refresh();
-                        break;
+        enable_custom_mode();
 
-                case ' ':
-                        change_dir();
+        while (!quit) {
+                if (dirty) {
+                        memory_check();
                         refresh();
-                        break;
+                        dirty = 0;
+                }
+                log_flush();
 
-                case '/':
-                        dprintf(stdout_fileno, "search >> ");
-                        fsync(stdout_fileno);
-                        search();
-                        refresh();
-                        break;
-                case 'n':
-                        select_matching_file(pattern);
-                        refresh();
+                timeout = -1;
+                if (watch.deadline) {
+                        timeout = watch.deadline - now_ms();
+                        if (timeout < 0) timeout = 0;
+                }
+                /* Redraw the progress of jobs and sizes from time to time */
+                if ((active_jobs.size || trees.active.size) && (timeout < 0 || timeout > JOB_REFRESH_MS))
+                        timeout = JOB_REFRESH_MS;
+                if (poll(fds, 4, timeout) < 0) {
+                        if (errno == EINTR) continue;
+                        error("Error polling events");
                         break;
+                }
 
-                case 13:
-                case '\b': // backspace
-                        if (!is_folder(dir_arr.data[selected_row].dirent)) {
-                                edit_file(dir_arr.data[selected_row].dirent.d_name, dir_arr.data[selected_row].path);
-                        } else if (is_folder_open(dir_arr.data[selected_row].dirent.d_name,
-                                                  dir_arr.data[selected_row].path))
-                                remove_subfolder(dir_arr.data[selected_row].dirent.d_name,
-                                                 dir_arr.data[selected_row].path);
-                        else
-                                add_subfolder(dir_arr.data[selected_row].dirent.d_name,
-                                              dir_arr.data[selected_row].path, selected_row + 1);
-                        refresh();
-                        break;
+                if (fds[1].revents & POLLIN) {
+                        while (read(sigfd, &si, sizeof si) > 0)
+                                ;
+                        calc_wsize(0);
+                        dirty = 1;
+                }
 
-                case 's':
-                        sort();
-                        refresh();
-                        break;
+                if (fds[2].revents & POLLIN) {
+                        load_process();
+                        meta_process();
+                        tree_process();
+                        job_process();
+                        if (index_poll()) finder.hits_valid = 0;
+                        reveal_step();
+                        dirty = 1;
+                }
 
-                case 'g':
-                        selected_row = 0;
-                        refresh();
-                        break;
-                case 'G':
-                        selected_row = dir_arr.size - 1;
-                        refresh();
-                        break;
+                if (fds[3].revents & POLLIN) watch_read();
+                if (watch.deadline && now_ms() >= watch.deadline) {
+                        watch_apply();
+                        dirty = 1;
+                }
+                if (active_jobs.size) dirty = 1;
 
-                default:
-                        refresh();
-                        break;
+                if (fds[0].revents & (POLLIN | POLLHUP)) {
+                        if ((n = read(STDIN_FILENO, buf, sizeof buf)) <= 0) {
+                                if (n < 0 && (errno == EINTR || errno == EAGAIN))
+                                        continue;
+                                error("Error reading from stdin");
+                                break;
+                        }
+                        for (i = 0; i < n && !quit; i += len) {
+                                len = parse_key(buf + i, n - i, &key);
+                                handle_key(key);
+                        }
+                        dirty = 1;
                 }
         }
 
         disable_custom_mode();
 }
 
+/* Parse s, a number not negative, to *n. Return -1 if it is not a number
+ * or too big */
+int
+parse_count(const char *s, int *n)
+{
+        char *end;
+        long v;
+
+        errno = 0;
+        v = strtol(s, &end, 10);
+        if (errno || end == s || *end || v < 0 || v > INT_MAX) return -1;
+        *n = v;
+        return 0;
+}
+
+/* Parse s, a number of MiB, to bytes in *bytes. Return -1 if it is not a
+ * number or too big */
+int
+parse_mib(const char *s, long long *bytes)
+{
+        char *end;
+        long long n;
+
+        errno = 0;
+        n = strtoll(s, &end, 10);
+        if (errno || end == s || *end || n < 0 || n > LLONG_MAX >> 20) return -1;
+        *bytes = n << 20;
+        return 0;
+}
+
 int
 main(int argc, char *argv[])
 {
         int i;
         char *path;
+        char *order;
+        char *depth_str;
+        char *size_str;
+        char *level;
+        char *pattern;
+        int recursive = 0;
+        int status;
         char cwd[1024];
+        struct rlimit rlim;
+        sigset_t mask;
 
+        atexit(log_flush);
         flag_set(&argc, &argv);
         if (flag_get("-E", "--external")) open_as_external = 1;
         if (flag_get("-I", "--internal")) open_as_external = 0;
         if (flag_get("-D", "--no-delete", "--dumb")) do_not_delete = 1;
+        if (flag_get_value(&order, "-s", "--sort")) {
+                for (i = 0; i < SORT_COUNT; i++)
+                        if (!strcmp(order, SORT_NAMES[i])) break;
+                if (i == SORT_COUNT) {
+                        report("Unknown sort order: %s", order);
+                        return -1;
+                }
+                sort_order = i;
+        }
+        if (flag_get_value(&level, "-l", "--log-level")) {
+                for (i = LOG_ERROR; i <= LOG_DEBUG; i++)
+                        if (!strcmp(level, LOG_NAMES[i])) break;
+                if (i > LOG_DEBUG) {
+                        report("Unknown log level: %s", level);
+                        return -1;
+                }
+                logger.level = i;
+        }
+        if (flag_get("-R", "--recursive")) recursive = 1;
+        if (flag_get("-c", "--columns")) metadata.columns = 1;
+        if (flag_get("-z", "--sizes")) trees.automatic = 1;
+        if (flag_get("-S", "--stats")) perf.dump = 1;
+        if (flag_get("-x", "--index")) file_index.enabled = 1;
+        if (flag_get("-p", "--list")) lister.active = sort_stat = 1;
+        if (flag_get("-o", "--ordered")) lister.ordered = 1;
+        if (flag_get("-0", "--null")) lister.sep = 0;
+        if (flag_get_value(&pattern, "-m", "--match")) {
+                search_set(pattern);
+                if (pattern[0] && !finder.compiled) {
+                        fprintf(stderr, "fl: invalid pattern: %s\n", pattern);
+                        return -1;
+                }
+        }
+        if (flag_get_value(&size_str, "-T", "--trash-size")) {
+                if (parse_mib(size_str, &journal.max)) {
+                        report("Invalid trash size: %s", size_str);
+                        return -1;
+                }
+        }
+        if (flag_get_value(&size_str, "-M", "--memory")) {
+                if (parse_mib(size_str, &memory.budget)) {
+                        report("Invalid memory budget: %s", size_str);
+                        return -1;
+                }
+        }
+        if (flag_get_value(&depth_str, "-L", "--depth")) {
+                if (parse_count(depth_str, &recursive_depth)) {
+                        report("Invalid depth: %s", depth_str);
+                        return -1;
+                }
+        }
         if (flag_get_value(&path, "-d", "--directory")) {
                 if (chdir(path)) {
                         error("Can not change dir to %s", path);
@@ -771,6 +7922,21 @@ main(int argc, char *argv[])
                 }
         }
 
+        /* Allow keeping many folders open */
+        if (!getrlimit(RLIMIT_NOFILE, &rlim)) {
+                rlim.rlim_cur = rlim.rlim_max;
+                setrlimit(RLIMIT_NOFILE, &rlim);
+                getrlimit(RLIMIT_NOFILE, &rlim);
+                if (rlim.rlim_cur > 1 << 20) rlim.rlim_cur = 1 << 20;
+                if (rlim.rlim_cur > 128) max_open_dirs = rlim.rlim_cur - 64;
+        }
+
+        if (lister.active) {
+                status = list_run(argv + 1, argc - 1, recursive ? recursive_depth : 1);
+                if (perf.dump) perf_dump();
+                return status;
+        }
+
         if (!isatty(STDIN_FILENO)) {
                 report("Can't use fl, stdin doesn't refer to a terminal");
                 return -1;
@@ -784,19 +7950,40 @@ main(int argc, char *argv[])
                 return -1;
         }
 
-        if (signal(SIGWINCH, calc_wsize) == SIG_ERR) {
-                report("Can't set window resize handler");
+        /* Window resizes are read from a signal fd by the event loop. It is
+         * blocked before starting any thread, so they all inherit it. */
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGWINCH);
+        if (sigprocmask(SIG_BLOCK, &mask, &origin_sigmask)) {
+                report("Can't block window resize signal");
+                return -1;
+        }
+
+        /* Without watches, folders are only updated when read again */
+        if ((watch.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+                error("Can not watch folders");
+
+        if ((posts.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+                report("Can't create event fd: %s", strerror(errno));
                 return -1;
         }
 
+        index_start();
+
+        /* Undo what was deleted in other runs */
+        journal_load();
+        trash_evict();
+
+        cursor_pending = 1;
         for (i = 1; i < argc; i++) {
-                add_subfolder(argv[i], NULL, -1);
+                add_root(argv[i], recursive ? recursive_depth : 1);
         }
-        add_subfolder(".", NULL, -1);
+        add_root(".", recursive ? recursive_depth : 1);
 
         calc_wsize(0);
-        place_cursor_midwindow();
         mainloop();
+        job_finish_all();
+        if (perf.dump) perf_dump();
         printf("%s\n", getcwd(cwd, 1024));
 
         return 0;